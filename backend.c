@@ -0,0 +1,871 @@
+#include "backend.h"
+
+#include "io.h"
+#include "spsc.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// io_uring is used through raw system calls, which needs the IORING_OP_READ
+// and IORING_OP_WRITE opcodes from Linux 5.6 (where IORING_FEAT_RW_CUR_POS
+// also appeared)
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_URING
+#endif
+
+#define URING_DEPTH 4 // Number of io_uring requests kept in flight
+
+#ifdef HAVE_URING
+//
+// An io_uring instance with its submission and completion rings mapped.
+//
+typedef struct Ring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+} Ring;
+
+//
+// A buffer with a request in flight.
+//
+// offset: File offset the request reads from or writes to
+// len: Number of bytes requested
+// res: Result of the request once done
+// busy: Set while the request is queued or its data is unconsumed
+// done: Set once the request has completed
+//
+typedef struct Slot {
+    uint64_t offset;
+    uint32_t len;
+    int32_t res;
+    bool busy;
+    bool done;
+} Slot;
+
+// Sets up an io_uring instance. Returns false if io_uring isn't available.
+static bool ring_init(Ring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return false;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_size = r->cq_size > r->sq_size ? r->cq_size : r->sq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+        IORING_OFF_SQ_RING);
+    r->cq_ptr = r->sq_ptr;
+    if (r->sq_ptr != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *) r->sq_ptr;
+    uint8_t *cq = (uint8_t *) r->cq_ptr;
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return true;
+}
+
+// Tears down an io_uring instance. No requests may be in flight.
+static void ring_close(Ring *r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    return;
+}
+
+// Queues a read or write of len bytes at offset and submits it
+static void ring_queue(
+    Ring *r, uint8_t opcode, int fd, uint8_t *buf, uint32_t len, uint64_t offset, uint64_t tag) {
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+    return;
+}
+
+// Waits for the next completion, passing back its tag and result
+static void ring_wait(Ring *r, uint64_t *tag, int32_t *res) {
+    while (true) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return;
+        }
+        syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+}
+
+// Waits until the request for slot i has completed
+static void slot_wait(Ring *r, Slot slots[static URING_DEPTH], uint32_t i) {
+    while (slots[i].busy && !slots[i].done) {
+        uint64_t tag;
+        int32_t res;
+        ring_wait(r, &tag, &res);
+        slots[tag].res = res;
+        slots[tag].done = true;
+    }
+    return;
+}
+#endif
+
+//
+// Definition of struct Input, a source of file data handed out in chunks.
+//
+// backend: How data is read
+// fd: File being read
+// size: Bytes per read
+// file_size: Size of the file, for backends which need a regular file
+// start: File offset reading started from, which input_rewind() returns to
+// offset: File offset of the next read
+// chunk: Current chunk of input
+// pos: Bytes of the chunk already handed out
+// len: Bytes in the chunk
+// buf: Read buffer (URING_DEPTH of them for io_uring)
+// map: Mapping of the whole file for BACKEND_MMAP
+// total: Bytes handed out so far
+// pipe, reader: Ring of chunks read ahead by the reader thread, once
+//   pipelined with input_pipeline()
+// wake: Pipe input_delete() writes to, to interrupt a reader thread waiting
+//   for input that may never come
+// held: Set while the chunk at the front of pipe is handed out
+// carry: Bytes left of the chunk being handed out when pipelining started
+// ring, slots, head, recycle: io_uring requests and the slot holding the
+//   next chunk; recycle is set once the head slot's data has been handed out
+//
+struct Input {
+    Backend backend;
+    int fd;
+    uint32_t size;
+    uint64_t file_size;
+    uint64_t start;
+    uint64_t offset;
+    uint8_t *chunk;
+    uint32_t pos;
+    uint32_t len;
+    uint8_t *buf;
+    uint8_t *map;
+    uint64_t total;
+    Spsc *pipe;
+    pthread_t reader;
+    int wake[2];
+    bool held;
+    uint8_t *carry;
+#ifdef HAVE_URING
+    Ring ring;
+    Slot slots[URING_DEPTH];
+    uint32_t head;
+    bool recycle;
+#endif
+};
+
+//
+// Definition of struct Output, a sink for file data which is buffered and
+// written out in chunks of size bytes.
+//
+// backend: How data is written
+// fd: File being written
+// size: Bytes per write
+// offset: File offset of the next write
+// buf: Write buffer (URING_DEPTH of them for io_uring)
+// cur: Buffer being filled
+// len: Bytes in cur
+// total: Bytes written out so far
+// pipe, writer: Ring of chunks written out by the writer thread, once
+//   pipelined with output_pipeline(); cur is then a chunk of pipe
+// ring, slots, head: io_uring requests, and the slot whose buffer is next
+//   written
+//
+struct Output {
+    Backend backend;
+    int fd;
+    uint32_t size;
+    uint64_t offset;
+    uint8_t *buf;
+    uint8_t *cur;
+    uint32_t len;
+    uint64_t total;
+    Spsc *pipe;
+    pthread_t writer;
+#ifdef HAVE_URING
+    Ring ring;
+    Slot slots[URING_DEPTH];
+    uint32_t head;
+#endif
+};
+
+static const char *backend_names[] = { "read", "pread", "mmap", "uring" };
+
+//
+// Parses a backend name (read, pread, mmap or uring). Returns false if the
+// name isn't recognized.
+//
+bool backend_parse(const char *name, Backend *backend) {
+    for (int i = 0; i <= BACKEND_URING; i++) {
+        if (strcmp(name, backend_names[i]) == 0) {
+            *backend = (Backend) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// Returns the name of a backend
+//
+const char *backend_name(Backend backend) {
+    return backend_names[backend];
+}
+
+#ifdef HAVE_URING
+// Queues a read into slot i at the current offset, unless the whole file has been queued
+static void uring_queue_read(Input *in, uint32_t i) {
+    if (in->offset >= in->file_size) {
+        return;
+    }
+    Slot *s = &in->slots[i];
+    s->offset = in->offset;
+    s->len = in->file_size - in->offset < in->size ? in->file_size - in->offset : in->size;
+    s->busy = true;
+    s->done = false;
+    ring_queue(&in->ring, IORING_OP_READ, in->fd, in->buf + (size_t) i * in->size, s->len,
+        s->offset, i);
+    in->offset += s->len;
+    return;
+}
+
+// Queues reads into every slot, starting at the current offset
+static void uring_queue_all(Input *in) {
+    in->head = 0;
+    in->recycle = false;
+    for (uint32_t i = 0; i < URING_DEPTH; i++) {
+        uring_queue_read(in, i);
+    }
+    return;
+}
+
+// Waits for every read in flight and marks the slots free
+static void uring_drain(Input *in) {
+    for (uint32_t i = 0; i < URING_DEPTH; i++) {
+        slot_wait(&in->ring, in->slots, i);
+        in->slots[i].busy = false;
+    }
+    return;
+}
+
+// Hands out the next slot's data through chunk once its read completes, and
+// reuses the previous slot's buffer to read further ahead. Returns 0 at EOF.
+static uint32_t uring_fill(Input *in, uint8_t **chunk) {
+    if (in->recycle) {
+        in->recycle = false;
+        in->slots[in->head].busy = false;
+        uring_queue_read(in, in->head);
+        in->head = (in->head + 1) % URING_DEPTH;
+    }
+    Slot *s = &in->slots[in->head];
+    if (!s->busy) {
+        return 0; // Nothing left in flight
+    }
+    slot_wait(&in->ring, in->slots, in->head);
+
+    uint8_t *buf = in->buf + (size_t) in->head * in->size;
+    int64_t n = s->res > 0 ? s->res : 0;
+    if (n < s->len) {
+        // Short read, so fetch the rest synchronously
+        int64_t rest = pread_bytes(in->fd, buf + n, s->len - n, s->offset + n);
+        n += rest > 0 ? rest : 0;
+    }
+    in->recycle = true;
+    *chunk = buf;
+    return (uint32_t) n;
+}
+#endif
+
+//
+// Constructor for an input - returns a pointer to an input reading fd in
+// chunks of up to size bytes through the given backend, or NULL if memory
+// can't be allocated. Backends which can't be used for fd fall back to
+// BACKEND_PREAD if fd is a regular file, and to BACKEND_READ otherwise.
+//
+Input *input_create(int fd, Backend backend, uint32_t size) {
+    Input *in = (Input *) calloc(1, sizeof(Input));
+    if (!in) {
+        return NULL;
+    }
+    in->fd = fd;
+    in->size = size;
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        backend = BACKEND_READ;
+    } else {
+        in->file_size = statbuf.st_size;
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        in->start = pos > 0 ? (uint64_t) pos : 0;
+        in->offset = in->start;
+    }
+
+    if (backend == BACKEND_MMAP && in->file_size > 0) {
+        in->map = (uint8_t *) mmap(NULL, in->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->map == MAP_FAILED) {
+            in->map = NULL;
+            backend = BACKEND_PREAD;
+        } else {
+            madvise(in->map, in->file_size, MADV_SEQUENTIAL);
+        }
+    }
+#ifdef HAVE_URING
+    if (backend == BACKEND_URING) {
+        in->buf = (uint8_t *) malloc((size_t) URING_DEPTH * size);
+        if (!in->buf || !ring_init(&in->ring, URING_DEPTH)) {
+            free(in->buf);
+            in->buf = NULL;
+            backend = BACKEND_PREAD;
+        } else {
+            uring_queue_all(in);
+        }
+    }
+#else
+    if (backend == BACKEND_URING) {
+        backend = BACKEND_PREAD;
+    }
+#endif
+    if (backend == BACKEND_READ || backend == BACKEND_PREAD) {
+        in->buf = (uint8_t *) malloc(size);
+        if (!in->buf) {
+            free(in);
+            return NULL;
+        }
+    }
+    in->backend = backend;
+    return in;
+}
+
+//
+// Destructor for an input. Waits for any reads in flight.
+//
+void input_delete(Input **in) {
+    if (*in) {
+        if ((*in)->pipe) {
+            // The reader may be waiting on the ring or on the file
+            uint8_t byte = 0;
+            spsc_stop((*in)->pipe);
+            write_bytes((*in)->wake[1], &byte, 1);
+            pthread_join((*in)->reader, NULL);
+            spsc_delete(&(*in)->pipe);
+            close((*in)->wake[0]);
+            close((*in)->wake[1]);
+        }
+        free((*in)->carry);
+#ifdef HAVE_URING
+        if ((*in)->backend == BACKEND_URING) {
+            uring_drain(*in);
+            ring_close(&(*in)->ring);
+        }
+#endif
+        if ((*in)->map) {
+            munmap((*in)->map, (*in)->file_size);
+        }
+        free((*in)->buf);
+        free(*in);
+        *in = NULL;
+    }
+    return;
+}
+
+//
+// Returns the backend an input ended up using
+//
+Backend input_backend(Input *in) {
+    return in->backend;
+}
+
+//
+// Reads the next chunk of input through the backend, into dst (size bytes)
+// for backends which copy, and passes back where it is through chunk.
+// Returns the number of bytes in it, 0 at EOF. BACKEND_READ hands out what a
+// single read() returns, so input from a pipe is passed on as it arrives
+// instead of once a whole chunk has.
+//
+static uint32_t input_load(Input *in, uint8_t *dst, uint8_t **chunk) {
+    int64_t n = 0;
+    switch (in->backend) {
+    case BACKEND_READ:
+        *chunk = dst;
+        do {
+            n = read(in->fd, dst, in->size);
+        } while (n < 0 && errno == EINTR);
+        return n > 0 ? n : 0;
+    case BACKEND_PREAD:
+        *chunk = dst;
+        n = pread_bytes(in->fd, dst, in->size, in->offset);
+        n = n > 0 ? n : 0;
+        break;
+    case BACKEND_MMAP:
+        *chunk = in->map + in->offset;
+        n = in->file_size - in->offset < in->size ? in->file_size - in->offset : in->size;
+        break;
+    case BACKEND_URING:
+#ifdef HAVE_URING
+        return uring_fill(in, chunk); // Offset is tracked by the queued reads
+#endif
+        break;
+    }
+    in->offset += n;
+    return n;
+}
+
+//
+// Waits until a BACKEND_READ input can be read without blocking. A pipe or
+// terminal may hold back input for ever, so the wake pipe is watched too.
+// Returns false if woken by input_delete().
+//
+static bool input_wait(Input *in) {
+    struct pollfd fds[2] = { { .fd = in->fd, .events = POLLIN }, { .fd = in->wake[0], .events = POLLIN } };
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return true; // Let the read itself fail
+        }
+    }
+    return fds[1].revents == 0;
+}
+
+//
+// Reader thread: reads chunks straight into the ring until EOF or the ring
+// is stopped. Input is read ahead of the caller, so reading from a pipe may
+// take bytes past the end of the data the caller wants, up to the chunks the
+// ring holds. input_delete() wakes a reader still waiting for input.
+//
+static void *input_reader(void *arg) {
+    Input *in = (Input *) arg;
+    uint8_t *slot;
+    while ((slot = spsc_reserve(in->pipe)) != NULL) {
+        uint8_t *chunk; // Always slot, only backends which copy are pipelined
+        if (in->backend == BACKEND_READ && !input_wait(in)) {
+            break;
+        }
+        uint32_t n = input_load(in, slot, &chunk);
+        spsc_commit(in->pipe, n);
+        if (n == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+//
+// Reads the next chunk of input, from the reader thread's ring once
+// pipelined. Returns the number of bytes in it, 0 at EOF.
+//
+static uint32_t input_fill(Input *in) {
+    uint32_t n = 0;
+    if (in->pipe) {
+        if (in->held) {
+            spsc_pop(in->pipe);
+        }
+        in->chunk = spsc_front(in->pipe, &n);
+        in->held = n > 0; // The end marker stays at the front for later calls
+    } else {
+        n = input_load(in, in->buf, &in->chunk);
+    }
+    in->total += n;
+    return n;
+}
+
+//
+// Moves reading onto a reader thread which reads up to chunks chunks ahead,
+// so reads overlap whatever the caller does with the data. The input can't be
+// rewound afterwards. Mapped input has no reads to overlap and io_uring reads
+// ahead by itself, so a reader thread would only copy their chunks. Returns
+// false for those backends, or if the thread can't be started, leaving the
+// input reading on the caller's thread.
+//
+bool input_pipeline(Input *in, uint32_t chunks) {
+    if (in->pipe) {
+        return true;
+    } else if (in->backend == BACKEND_MMAP || in->backend == BACKEND_URING) {
+        return false;
+    }
+    // The rest of the current chunk may be in a buffer the reader reuses
+    uint32_t rest = in->len - in->pos;
+    if (rest > 0) {
+        in->carry = (uint8_t *) malloc(rest);
+        if (!in->carry) {
+            return false;
+        }
+        memcpy(in->carry, in->chunk + in->pos, rest);
+        in->chunk = in->carry;
+        in->pos = 0;
+        in->len = rest;
+    }
+    if (pipe(in->wake) != 0) {
+        return false;
+    }
+    in->pipe = spsc_create(chunks, in->size);
+    if (!in->pipe || pthread_create(&in->reader, NULL, input_reader, in) != 0) {
+        spsc_delete(&in->pipe);
+        close(in->wake[0]);
+        close(in->wake[1]);
+        return false;
+    }
+    return true;
+}
+
+//
+// Passes back through data a pointer to the next bytes of input, which stay
+// valid until the next call. Returns the number of bytes available, 0 at EOF.
+//
+uint32_t input_next(Input *in, uint8_t **data) {
+    if (in->pos == in->len) {
+        in->pos = 0;
+        in->len = input_fill(in);
+    }
+    *data = in->chunk + in->pos;
+    uint32_t n = in->len - in->pos;
+    in->pos = in->len;
+    return n;
+}
+
+//
+// Copies the next n bytes of input into buf. Returns the number of bytes
+// copied, which is less than n only at EOF.
+//
+uint64_t input_read(Input *in, uint8_t *buf, uint64_t n) {
+    uint64_t total = 0;
+    while (total < n) {
+        if (in->pos == in->len) {
+            in->pos = 0;
+            in->len = input_fill(in);
+            if (in->len == 0) {
+                break;
+            }
+        }
+        uint64_t k = in->len - in->pos < n - total ? in->len - in->pos : n - total;
+        memcpy(buf + total, in->chunk + in->pos, k);
+        in->pos += k;
+        total += k;
+    }
+    return total;
+}
+
+// Returns the number of bytes read through an input so far
+uint64_t input_bytes(Input *in) {
+    return in->total;
+}
+
+//
+// Starts reading again from the offset the file was at when the input was
+// created. Returns false if the file can't be rewound, or the input is
+// pipelined.
+//
+bool input_rewind(Input *in) {
+    if (in->pipe) {
+        return false;
+    }
+    in->pos = 0;
+    in->len = 0;
+    in->offset = in->start;
+#ifdef HAVE_URING
+    if (in->backend == BACKEND_URING) {
+        uring_drain(in);
+        uring_queue_all(in);
+        return true;
+    }
+#endif
+    if (in->backend == BACKEND_READ) {
+        return lseek(in->fd, in->start, SEEK_SET) == (off_t) in->start;
+    }
+    if (in->backend == BACKEND_MMAP && in->map) {
+        madvise(in->map, in->file_size, MADV_SEQUENTIAL);
+    }
+    return true;
+}
+
+#ifdef HAVE_URING
+// Waits for the write in slot i, finishing it synchronously if it came up short
+static void uring_finish_write(Output *out, uint32_t i) {
+    Slot *s = &out->slots[i];
+    if (!s->busy) {
+        return;
+    }
+    slot_wait(&out->ring, out->slots, i);
+    uint32_t n = s->res > 0 ? (uint32_t) s->res : 0;
+    if (n < s->len) {
+        pwrite_bytes(out->fd, out->buf + (size_t) i * out->size + n, s->len - n, s->offset + n);
+    }
+    s->busy = false;
+    return;
+}
+
+// Queues a write of the len bytes of the head slot's buffer, then moves on to
+// the next buffer once its previous write is done
+static void uring_queue_write(Output *out, uint32_t len) {
+    Slot *s = &out->slots[out->head];
+    s->offset = out->offset;
+    s->len = len;
+    s->busy = true;
+    s->done = false;
+    ring_queue(&out->ring, IORING_OP_WRITE, out->fd, out->buf + (size_t) out->head * out->size, len, out->offset,
+        out->head);
+    out->offset += len;
+    out->head = (out->head + 1) % URING_DEPTH;
+    uring_finish_write(out, out->head);
+    return;
+}
+#endif
+
+//
+// Constructor for an output - returns a pointer to an output writing to fd
+// in chunks of size bytes through the given backend, or NULL if memory can't
+// be allocated. BACKEND_MMAP writes with write(). Backends which can't be
+// used for fd fall back like input_create().
+//
+Output *output_create(int fd, Backend backend, uint32_t size) {
+    Output *out = (Output *) calloc(1, sizeof(Output));
+    if (!out) {
+        return NULL;
+    }
+    out->fd = fd;
+    out->size = size;
+
+    struct stat statbuf;
+    if (backend == BACKEND_MMAP || fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        backend = BACKEND_READ;
+    } else {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        out->offset = pos > 0 ? (uint64_t) pos : 0;
+    }
+#ifdef HAVE_URING
+    if (backend == BACKEND_URING) {
+        out->buf = (uint8_t *) malloc((size_t) URING_DEPTH * size);
+        if (!out->buf || !ring_init(&out->ring, URING_DEPTH)) {
+            free(out->buf);
+            out->buf = NULL;
+            backend = BACKEND_PREAD;
+        }
+    }
+#else
+    if (backend == BACKEND_URING) {
+        backend = BACKEND_PREAD;
+    }
+#endif
+    if (!out->buf) {
+        out->buf = (uint8_t *) malloc(size);
+        if (!out->buf) {
+            free(out);
+            return NULL;
+        }
+    }
+    out->backend = backend;
+    out->cur = out->buf;
+    return out;
+}
+
+// Writes out the len bytes of buf through the backend
+static void output_put(Output *out, uint8_t *buf, uint32_t len) {
+    switch (out->backend) {
+    case BACKEND_READ:
+    case BACKEND_MMAP:
+        write_bytes(out->fd, buf, len);
+        break;
+    case BACKEND_PREAD:
+        pwrite_bytes(out->fd, buf, len, out->offset);
+        out->offset += len;
+        break;
+    case BACKEND_URING:
+#ifdef HAVE_URING
+        if (buf != out->buf + (size_t) out->head * out->size) {
+            memcpy(out->buf + (size_t) out->head * out->size, buf, len);
+        }
+        uring_queue_write(out, len);
+#endif
+        break;
+    }
+    return;
+}
+
+// Returns the backend's buffer to fill next
+static uint8_t *output_buffer(Output *out) {
+#ifdef HAVE_URING
+    if (out->backend == BACKEND_URING) {
+        return out->buf + (size_t) out->head * out->size;
+    }
+#endif
+    return out->buf;
+}
+
+// Writes out the buffer being filled, or hands it to the writer thread once
+// pipelined
+static void output_submit(Output *out) {
+    out->total += out->len;
+    if (out->pipe) {
+        spsc_commit(out->pipe, out->len);
+        out->cur = spsc_reserve(out->pipe);
+    } else {
+        output_put(out, out->cur, out->len);
+        out->cur = output_buffer(out);
+    }
+    out->len = 0;
+    return;
+}
+
+// Writer thread: writes out chunks from the ring until the end marker
+static void *output_writer(void *arg) {
+    Output *out = (Output *) arg;
+    uint32_t len = 0;
+    uint8_t *chunk;
+    while ((chunk = spsc_front(out->pipe, &len)) != NULL && len > 0) {
+        output_put(out, chunk, len);
+        spsc_pop(out->pipe);
+    }
+    return NULL;
+}
+
+//
+// Moves writing onto a writer thread with up to chunks chunks queued for
+// it, so writes overlap whatever the caller does in between. The caller
+// waits only when the queue is full. output_flush() stops the thread.
+// Returns false if the thread can't be started, leaving the output writing
+// on the caller's thread.
+//
+bool output_pipeline(Output *out, uint32_t chunks) {
+    if (out->pipe) {
+        return true;
+    }
+    out->pipe = spsc_create(chunks, out->size);
+    if (!out->pipe) {
+        return false;
+    }
+    if (pthread_create(&out->writer, NULL, output_writer, out) != 0) {
+        spsc_delete(&out->pipe);
+        return false;
+    }
+    // Carry over what is already buffered
+    uint8_t *chunk = spsc_reserve(out->pipe);
+    memcpy(chunk, out->cur, out->len);
+    out->cur = chunk;
+    return true;
+}
+
+//
+// Destructor for an output. Flushes any buffered data first.
+//
+void output_delete(Output **out) {
+    if (*out) {
+        output_flush(*out);
+#ifdef HAVE_URING
+        if ((*out)->backend == BACKEND_URING) {
+            ring_close(&(*out)->ring);
+        }
+#endif
+        free((*out)->buf);
+        free(*out);
+        *out = NULL;
+    }
+    return;
+}
+
+//
+// Buffers n bytes of buf to be written out
+//
+void output_write(Output *out, uint8_t *buf, uint64_t n) {
+    while (n > 0) {
+        uint64_t k = out->size - out->len < n ? out->size - out->len : n;
+        memcpy(out->cur + out->len, buf, k);
+        out->len += k;
+        buf += k;
+        n -= k;
+        if (out->len == out->size) {
+            output_submit(out);
+        }
+    }
+    return;
+}
+
+// Returns the number of bytes written to an output so far, buffered or not
+uint64_t output_bytes(Output *out) {
+    return out->total + out->len;
+}
+
+//
+// Writes out all buffered data and waits for it to reach the file, stopping
+// the writer thread of a pipelined output
+//
+void output_flush(Output *out) {
+    if (out->pipe) {
+        if (out->len > 0) {
+            output_submit(out);
+        }
+        spsc_commit(out->pipe, 0);
+        pthread_join(out->writer, NULL);
+        spsc_delete(&out->pipe);
+        out->cur = output_buffer(out);
+    }
+    if (out->len > 0) {
+        output_submit(out);
+    }
+#ifdef HAVE_URING
+    if (out->backend == BACKEND_URING) {
+        for (uint32_t i = 0; i < URING_DEPTH; i++) {
+            uring_finish_write(out, i);
+        }
+    }
+#endif
+    return;
+}
@@ -0,0 +1,56 @@
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Ways of moving file data in and out:
+//
+// BACKEND_READ: Looped read()/write() calls through a buffer
+// BACKEND_PREAD: pread()/pwrite() at tracked offsets through a buffer
+// BACKEND_MMAP: Input is mapped into memory and read in place (output uses write())
+// BACKEND_URING: Reads ahead and writes behind with several io_uring requests in flight
+//
+// Every backend but BACKEND_READ needs a regular file, and falls back to
+// BACKEND_READ for pipes, sockets and terminals.
+//
+typedef enum Backend { BACKEND_READ, BACKEND_PREAD, BACKEND_MMAP, BACKEND_URING } Backend;
+
+typedef struct Input Input;
+
+typedef struct Output Output;
+
+bool backend_parse(const char *name, Backend *backend);
+
+const char *backend_name(Backend backend);
+
+Input *input_create(int fd, Backend backend, uint32_t size);
+
+void input_delete(Input **in);
+
+Backend input_backend(Input *in);
+
+uint32_t input_next(Input *in, uint8_t **data);
+
+uint64_t input_read(Input *in, uint8_t *buf, uint64_t n);
+
+uint64_t input_bytes(Input *in);
+
+bool input_rewind(Input *in);
+
+bool input_pipeline(Input *in, uint32_t chunks);
+
+Output *output_create(int fd, Backend backend, uint32_t size);
+
+void output_delete(Output **out);
+
+void output_write(Output *out, uint8_t *buf, uint64_t n);
+
+uint64_t output_bytes(Output *out);
+
+void output_flush(Output *out);
+
+bool output_pipeline(Output *out, uint32_t chunks);
+
+#endif
@@ -0,0 +1,379 @@
+#include "code.h"
+#include "defines.h"
+#include "histogram.h"
+#include "huffman.h"
+#include "io.h"
+#include "libhuffman.h"
+#include "table.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define OPTIONS    "hr:s:f:"
+#define MAX_FILES  16
+#define MAX_SIZES  8
+#define MIN_BYTES  (8 << 20) // Each timed run covers at least this much input
+#define MAX_INPUT  (UINT64_C(1) << 31) // Largest input the single stream phases take
+#define SEED       0x9E3779B97F4A7C15
+
+//
+// A corpus input: generated data of the given size, or a file loaded whole.
+//
+typedef struct Corpus {
+    const char *name;
+    uint8_t *data;
+    uint64_t size;
+} Corpus;
+
+//
+// State shared by the phases of one corpus input. Each phase reads what the
+// phases before it left behind, so they can be timed one at a time.
+//
+typedef struct Bench {
+    Corpus *corpus;
+    uint64_t hist[ALPHABET];
+    uint8_t lengths[ALPHABET];
+    Code codes[ALPHABET];
+    PackedCode packed[ALPHABET];
+    DecodeTable table;
+    uint8_t *coded;
+    uint64_t coded_size;
+    uint8_t *decoded;
+    uint8_t *block;
+    uint64_t compressed_size;
+} Bench;
+
+typedef void (*Phase)(Bench *b);
+
+static uint64_t state = SEED;
+
+static void usage(char *exec) {
+    fprintf(stderr,
+        "SYNOPSIS\n"
+        "  Benchmarks the phases of Huffman coding on a standard corpus.\n"
+        "\n"
+        "USAGE\n"
+        "  %s [-h] [-r runs] [-s sizes] [-f file]...\n"
+        "\n"
+        "OPTIONS\n"
+        "  -h               Program usage and help.\n"
+        "  -r runs          Timed runs per phase (default: 5).\n"
+        "  -s sizes         Comma separated corpus sizes in KB (default: 64,1024,16384).\n"
+        "  -f file          Benchmark a file as well as the generated corpus.\n",
+        exec);
+}
+
+// Returns the next number from a xorshift generator, so corpora are the same every run
+static uint64_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Returns a reading of the time stamp counter, or 0 where there is none
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Returns the monotonic time in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// English-like text: words drawn from a small vocabulary, favoring the first ones
+static void gen_text(uint8_t *buf, uint64_t n) {
+    static const char *words[] = { "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was",
+        "with", "be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have",
+        "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been",
+        "huffman", "symbol", "frequency", "tree", "code", "length", "table", "block", "stream" };
+    uint32_t nwords = sizeof(words) / sizeof(words[0]);
+    uint64_t i = 0;
+    while (i < n) {
+        // Minimum of two draws skews toward common words
+        uint32_t a = next_random() % nwords, b = next_random() % nwords;
+        const char *w = words[a < b ? a : b];
+        for (uint32_t j = 0; w[j] && i < n; j++) {
+            buf[i++] = (uint8_t) w[j];
+        }
+        if (i < n) {
+            buf[i++] = next_random() % 12 == 0 ? (next_random() % 2 ? '.' : '\n') : ' ';
+        }
+    }
+    return;
+}
+
+// Binary records: an increasing id, a few small fields and a double
+static void gen_binary(uint8_t *buf, uint64_t n) {
+    uint64_t i = 0;
+    for (uint32_t id = 0; i < n; id++) {
+        uint8_t record[20];
+        double value = (double) (next_random() % 100000) / 100.0;
+        uint16_t fields[2] = { (uint16_t) (next_random() % 64), (uint16_t) (id % 7) };
+        memcpy(record, &id, 4);
+        memcpy(record + 4, fields, 4);
+        memcpy(record + 8, &value, 8);
+        memset(record + 16, 0, 4);
+        for (uint32_t j = 0; j < sizeof(record) && i < n; j++) {
+            buf[i++] = record[j];
+        }
+    }
+    return;
+}
+
+// Uniformly random bytes
+static void gen_random(uint8_t *buf, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        buf[i] = (uint8_t) next_random();
+    }
+    return;
+}
+
+// Geometrically distributed bytes: symbol k appears with probability 2^-(k+1)
+static void gen_skewed(uint8_t *buf, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t r = next_random() | (UINT64_C(1) << 63);
+        buf[i] = (uint8_t) __builtin_ctzll(r);
+    }
+    return;
+}
+
+// A single symbol repeated
+static void gen_single(uint8_t *buf, uint64_t n) {
+    memset(buf, 'a', n);
+    return;
+}
+
+// Counts the histogram, with the same extra 0 and 255 as a single stream file
+static void phase_histogram(Bench *b) {
+    memset(b->hist, 0, sizeof(b->hist));
+    b->hist[0] += 1;
+    b->hist[255] += 1;
+    histogram_add(b->hist, b->corpus->data, b->corpus->size);
+    return;
+}
+
+// Builds the code lengths, canonical codes and decode table from the histogram
+static void phase_table(Bench *b) {
+    optimal_lengths(b->hist, b->lengths);
+    canonical_codes(b->lengths, b->codes);
+    for (int i = 0; i < ALPHABET; i++) {
+        b->packed[i] = code_pack(&b->codes[i]);
+    }
+    table_build_canonical(&b->table, b->lengths);
+    return;
+}
+
+// Codes the whole input as a single stream
+static void phase_encode(Bench *b) {
+    BitWriter w;
+    bit_writer_init(&w, b->coded, b->corpus->size * 2 + 16);
+    for (uint64_t i = 0; i < b->corpus->size; i += MAX_BLOCK) {
+        uint64_t n = b->corpus->size - i < MAX_BLOCK ? b->corpus->size - i : MAX_BLOCK;
+        write_symbols(&w, b->packed, b->codes, b->corpus->data + i, n);
+    }
+    b->coded_size = bit_writer_finish(&w);
+    return;
+}
+
+// Decodes the single stream back
+static void phase_decode(Bench *b) {
+    BitReader r;
+    bit_reader_init(&r, NULL, b->coded, b->coded_size);
+    table_decode(&b->table, &r, b->decoded, b->corpus->size);
+    return;
+}
+
+// Compresses with the library, in blocks
+static void phase_compress(Bench *b) {
+    uint64_t cap = huff_compress_bound(b->corpus->size, 0);
+    huff_compress(b->corpus->data, b->corpus->size, b->block, cap, &b->compressed_size, 0, 0);
+    return;
+}
+
+// Decompresses with the library
+static void phase_decompress(Bench *b) {
+    uint64_t size;
+    huff_decompress(b->block, b->compressed_size, b->decoded, b->corpus->size, &size);
+    return;
+}
+
+static const char *phase_names[] = { "histogram", "table", "encode", "decode", "compress", "decompress" };
+
+static Phase phases[] = { phase_histogram, phase_table, phase_encode, phase_decode, phase_compress, phase_decompress };
+
+//
+// Times runs runs of each phase on a corpus input and prints the mean
+// throughput, its relative standard deviation, the mean time of one pass
+// over the input, and time stamp counter cycles per byte. Small inputs are
+// repeated within a run to cover at least MIN_BYTES. Returns false if the
+// data doesn't survive a round trip.
+//
+static bool bench_corpus(Corpus *c, uint32_t runs) {
+    if (c->size == 0 || c->size > MAX_INPUT) {
+        fprintf(stderr, "%s: Skipped, size must be 1 byte to 2GB.\n", c->name);
+        return true;
+    }
+    Bench *b = (Bench *) calloc(1, sizeof(Bench));
+    if (!b) {
+        return false;
+    }
+    b->corpus = c;
+    b->coded = (uint8_t *) malloc(c->size * 2 + 16);
+    b->decoded = (uint8_t *) malloc(c->size + 1);
+    b->block = (uint8_t *) malloc(huff_compress_bound(c->size, 0));
+    if (!b->coded || !b->decoded || !b->block) {
+        free(b->coded);
+        free(b->decoded);
+        free(b->block);
+        free(b);
+        return false;
+    }
+
+    uint32_t reps = c->size >= MIN_BYTES ? 1 : (MIN_BYTES + c->size - 1) / c->size;
+    uint32_t nphases = sizeof(phases) / sizeof(phases[0]);
+    bool ok = true;
+    for (uint32_t p = 0; p < nphases; p++) {
+        double sum = 0.0, sum_sq = 0.0, cpb = 0.0, usec = 0.0;
+        phases[p](b); // Warm up
+        for (uint32_t r = 0; r < runs; r++) {
+            double start = now();
+            uint64_t start_cycles = cycles();
+            for (uint32_t k = 0; k < reps; k++) {
+                phases[p](b);
+            }
+            uint64_t elapsed_cycles = cycles() - start_cycles;
+            double elapsed = now() - start;
+            double rate = (double) c->size * reps / elapsed / 1e6;
+            sum += rate;
+            sum_sq += rate * rate;
+            cpb += (double) elapsed_cycles / ((double) c->size * reps) / runs;
+            usec += elapsed * 1e6 / reps / runs;
+        }
+        double mean = sum / runs;
+        double var = runs > 1 ? (sum_sq - sum * sum / runs) / (runs - 1) : 0.0;
+        double dev = var > 0 ? 100.0 * sqrt(var) / mean : 0.0;
+        printf("%-12s %10" PRIu64 "  %-10s %10.1f %7.1f%% %12.1f %10.2f\n", c->name, c->size, phase_names[p], mean, dev,
+            usec, cpb);
+
+        // Check each decoder's output after it runs
+        if ((phases[p] == phase_decode || phases[p] == phase_decompress)
+            && memcmp(b->decoded, c->data, c->size) != 0) {
+            fprintf(stderr, "%s: %s output doesn't match the input.\n", c->name, phase_names[p]);
+            ok = false;
+        }
+    }
+    printf("%-12s %10" PRIu64 "  %-10s %10.3f\n", c->name, c->size, "ratio",
+        c->size ? (double) b->compressed_size / c->size : 0.0);
+
+    free(b->coded);
+    free(b->decoded);
+    free(b->block);
+    free(b);
+    return ok;
+}
+
+// Loads a whole file into a corpus input. Returns false if it can't be read.
+static bool load_file(const char *name, Corpus *c) {
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        return false;
+    }
+    c->name = name;
+    c->data = NULL;
+    c->size = 0;
+    uint64_t capacity = 0;
+    size_t bytes;
+    do {
+        if (c->size == capacity) {
+            capacity = capacity ? 2 * capacity : 1 << 20;
+            uint8_t *grown = (uint8_t *) realloc(c->data, capacity);
+            if (!grown) {
+                break;
+            }
+            c->data = grown;
+        }
+        bytes = fread(c->data + c->size, 1, capacity - c->size, f);
+        c->size += bytes;
+    } while (bytes > 0);
+    bool ok = !ferror(f) && c->data;
+    fclose(f);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    uint32_t runs = 5;
+    uint64_t sizes[MAX_SIZES] = { 64, 1024, 16384 };
+    uint32_t nsizes = 3;
+    const char *files[MAX_FILES];
+    uint32_t nfiles = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': usage(argv[0]); return EXIT_SUCCESS;
+        case 'r': runs = strtoul(optarg, NULL, 10); break;
+        case 's':
+            nsizes = 0;
+            for (char *s = strtok(optarg, ","); s && nsizes < MAX_SIZES; s = strtok(NULL, ",")) {
+                sizes[nsizes++] = strtoull(s, NULL, 10);
+            }
+            break;
+        case 'f':
+            if (nfiles < MAX_FILES) {
+                files[nfiles++] = optarg;
+            }
+            break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (runs == 0 || nsizes == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static const char *gen_names[] = { "text", "binary", "random", "skewed", "single" };
+    static void (*gens[])(uint8_t *, uint64_t) = { gen_text, gen_binary, gen_random, gen_skewed, gen_single };
+
+    printf("%-12s %10s  %-10s %10s %8s %12s %10s\n", "corpus", "bytes", "phase", "MB/s", "stddev", "us/pass",
+        "cycles/B");
+    bool ok = true;
+    for (uint32_t s = 0; s < nsizes; s++) {
+        for (uint32_t g = 0; g < sizeof(gens) / sizeof(gens[0]); g++) {
+            Corpus c = { .name = gen_names[g], .size = sizes[s] * 1024 };
+            c.data = (uint8_t *) malloc(c.size + 1);
+            if (!c.data) {
+                fprintf(stderr, "Failed to allocate corpus.\n");
+                return EXIT_FAILURE;
+            }
+            state = SEED;
+            gens[g](c.data, c.size);
+            ok = bench_corpus(&c, runs) && ok;
+            free(c.data);
+        }
+    }
+    for (uint32_t f = 0; f < nfiles; f++) {
+        Corpus c;
+        if (!load_file(files[f], &c)) {
+            fprintf(stderr, "Failed to read %s.\n", files[f]);
+            free(c.data);
+            return EXIT_FAILURE;
+        }
+        ok = bench_corpus(&c, runs) && ok;
+        free(c.data);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,358 @@
+#include "block.h"
+
+#include "code.h"
+#include "context.h"
+#include "defines.h"
+#include "histogram.h"
+#include "huffman.h"
+#include "io.h"
+#include "table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Returns a newly allocated block of type with no code table, whose block
+// data is the nbytes of data, and passes back its size through size
+static uint8_t *block_uncoded(uint8_t type, uint32_t n, uint8_t *data, uint32_t nbytes, uint32_t *size) {
+    uint8_t *buf = (uint8_t *) malloc(sizeof(BlockHeader) + nbytes);
+    if (!buf) {
+        return NULL;
+    }
+    BlockHeader bh;
+    bh.raw_size = n;
+    bh.comp_size = nbytes;
+    bh.table_size = 0;
+    bh.type = type;
+    bh.flags = 0;
+    memcpy(buf, &bh, sizeof(BlockHeader));
+    memcpy(buf + sizeof(BlockHeader), data, nbytes);
+    *size = sizeof(BlockHeader) + nbytes;
+    return buf;
+}
+
+//
+// Picks the type of a block of n bytes with histogram hist and passes it
+// back through type. A single repeated symbol makes a BLOCK_RLE block, and
+// input which coding wouldn't shrink a BLOCK_STORED block. Otherwise the
+// block is BLOCK_HUFFMAN, and lengths and table are filled in with its code
+// lengths, limited to limit bits if limit is not 0, and their dump, whose
+// size is passed back through table_size. Returns false if the code lengths
+// can't be limited.
+//
+bool block_plan(uint64_t hist[static ALPHABET], uint32_t n, uint8_t limit, bool streams,
+    uint8_t lengths[static ALPHABET], uint8_t table[static MAX_LENS_SIZE], uint16_t *table_size, uint8_t *type) {
+    uint32_t symbols = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        symbols += hist[i] != 0;
+    }
+    if (symbols <= 1) {
+        *type = BLOCK_RLE;
+        return true;
+    }
+
+    optimal_lengths(hist, lengths);
+    if (limit && !limit_lengths(hist, lengths, limit)) {
+        return false;
+    }
+
+    // Store the block if the code table, coded bits and the padding and sizes
+    // of the streams would take as much as the input
+    *table_size = lengths_dump(lengths, table);
+    uint64_t overhead = streams ? 4 * (STREAMS - 1) + STREAMS : 1;
+    *type = *table_size + coded_bits(hist, lengths) / 8 + overhead >= n ? BLOCK_STORED : BLOCK_HUFFMAN;
+    return true;
+}
+
+//
+// Returns the size block_encode() gives a block of n bytes, header
+// included, without coding it, and passes back the block type through type.
+// parts holds the histograms of the STREAMS runs the block is split into
+// when streams is set (see BLOCK_STREAMS). Returns 0 if the code lengths
+// can't be limited.
+//
+uint32_t block_coded_size(
+    uint64_t parts[static STREAMS][ALPHABET], uint32_t n, uint8_t limit, bool streams, uint8_t *type) {
+    uint64_t hist[ALPHABET] = { 0 };
+    for (uint32_t k = 0; k < STREAMS; k++) {
+        for (int i = 0; i < ALPHABET; i++) {
+            hist[i] += parts[k][i];
+        }
+    }
+    uint8_t lengths[ALPHABET];
+    uint8_t table[MAX_LENS_SIZE];
+    uint16_t table_size = 0;
+    if (!block_plan(hist, n, limit, streams, lengths, table, &table_size, type)) {
+        return 0;
+    } else if (*type == BLOCK_RLE) {
+        return sizeof(BlockHeader) + (n ? 1 : 0);
+    } else if (*type == BLOCK_STORED) {
+        return sizeof(BlockHeader) + n;
+    } else if (!streams) {
+        return sizeof(BlockHeader) + table_size + (coded_bits(hist, lengths) + 7) / 8;
+    }
+    uint32_t size = sizeof(BlockHeader) + table_size + 4 * (STREAMS - 1);
+    for (uint32_t k = 0; k < STREAMS; k++) {
+        size += (coded_bits(parts[k], lengths) + 7) / 8;
+    }
+    return size;
+}
+
+//
+// Writes the codes for the n bytes of src into buf from offset, which has
+// room for capacity bytes, either with the order-0 codes packed and codes or,
+// if m is not NULL, the order-1 codes of m. If streams is set, the codes are
+// split into STREAMS bitstreams preceded by their sizes, each coded on its
+// own. Returns the offset after the last written byte.
+//
+static uint32_t block_write(uint8_t *buf, size_t capacity, uint32_t offset, uint8_t *src, uint32_t n, bool streams,
+    PackedCode packed[static ALPHABET], Code codes[static ALPHABET], ContextModel *m) {
+    uint32_t runs = streams ? STREAMS : 1;
+    uint32_t sizes = offset;
+    offset += 4 * (runs - 1);
+    for (uint32_t k = 0; k < runs; k++) {
+        uint32_t start = k * (n / runs);
+        uint32_t len = k == runs - 1 ? n - start : n / runs;
+        BitWriter writer;
+        bit_writer_init(&writer, buf + offset, (uint32_t) (capacity - offset));
+        if (m) {
+            context_write(&writer, m, src + start, len);
+        } else {
+            write_symbols(&writer, packed, codes, src + start, len);
+        }
+        uint32_t nbytes = bit_writer_finish(&writer);
+        if (k < runs - 1) {
+            for (uint32_t j = 0; j < 4; j++) {
+                buf[sizes + 4 * k + j] = (uint8_t) (nbytes >> (8 * j));
+            }
+        }
+        offset += nbytes;
+    }
+    return offset;
+}
+
+//
+// Compresses n bytes of src as a single block with its own canonical code
+// table, limited to limit bits if limit is not 0. If streams is set, the
+// codes are split into STREAMS bitstreams. The block type is picked by
+// block_plan(), except that if contexts is more than 1, a BLOCK_CONTEXT
+// block with up to contexts code tables is made instead when it comes out
+// smaller. Returns a newly allocated buffer holding the BlockHeader followed
+// by the block data, and passes back its size through size. Returns NULL if
+// memory can't be allocated or the code lengths can't be limited.
+//
+uint8_t *block_encode(uint8_t *src, uint32_t n, uint8_t limit, bool streams, uint32_t contexts, uint32_t *size) {
+    uint64_t hist[ALPHABET] = { 0 };
+    histogram_add(hist, src, n);
+    uint8_t lengths[ALPHABET];
+    uint8_t table[MAX_LENS_SIZE];
+    uint16_t table_size = 0;
+    uint8_t type = BLOCK_HUFFMAN;
+    if (!block_plan(hist, n, limit, streams, lengths, table, &table_size, &type)) {
+        return NULL;
+    } else if (type == BLOCK_RLE) {
+        return block_uncoded(BLOCK_RLE, n, src, n ? 1 : 0, size);
+    }
+
+    // Try the order-1 model against what block_plan() picked
+    ContextModel *m = NULL;
+    uint16_t model_size = 0;
+    uint8_t *model = NULL;
+    if (contexts > 1) {
+        m = (ContextModel *) malloc(sizeof(ContextModel));
+        model = (uint8_t *) malloc(MAX_CONTEXT_SIZE);
+        if (!m || !model) {
+            free(m);
+            free(model);
+            return NULL;
+        }
+        uint64_t overhead = streams ? 4 * (STREAMS - 1) + STREAMS : 1;
+        uint64_t best = type == BLOCK_STORED ? n : table_size + coded_bits(hist, lengths) / 8 + overhead;
+        uint64_t bits = context_plan(m, src, n, contexts, limit, streams);
+        if (bits == UINT64_MAX) {
+            free(m);
+            free(model);
+            return NULL;
+        }
+        model_size = context_dump(m, model);
+        if (model_size + bits / 8 + overhead >= best) {
+            free(m);
+            free(model);
+            m = NULL;
+            model = NULL;
+        } else {
+            type = BLOCK_CONTEXT;
+        }
+    }
+    if (type == BLOCK_STORED) {
+        return block_uncoded(BLOCK_STORED, n, src, n, size);
+    }
+
+    // Compute the canonical codes from the lengths
+    Code codes[ALPHABET] = { 0 };
+    PackedCode packed[ALPHABET];
+    uint32_t max_length = 0;
+    if (m) {
+        context_codes(m);
+        for (uint32_t j = 0; j < m->tables; j++) {
+            for (int i = 0; i < ALPHABET; i++) {
+                max_length = m->lengths[j][i] > max_length ? m->lengths[j][i] : max_length;
+            }
+        }
+    } else {
+        canonical_codes(lengths, codes);
+        for (int i = 0; i < ALPHABET; i++) {
+            packed[i] = code_pack(&codes[i]);
+            max_length = lengths[i] > max_length ? lengths[i] : max_length;
+        }
+    }
+
+    // Room for the headers and n codes of the longest length, plus stream
+    // sizes and slack for the word stores of each stream
+    size_t capacity = sizeof(BlockHeader) + MAX_CONTEXT_SIZE + ((size_t) n * max_length) / 8 + 16 * STREAMS;
+    uint8_t *buf = (uint8_t *) malloc(capacity);
+    if (!buf) {
+        free(m);
+        free(model);
+        return NULL;
+    }
+
+    BlockHeader bh;
+    bh.raw_size = n;
+    if (m) {
+        bh.table_size = model_size;
+        memcpy(buf + sizeof(BlockHeader), model, model_size);
+    } else {
+        bh.table_size = table_size;
+        memcpy(buf + sizeof(BlockHeader), table, table_size);
+    }
+    bh.type = type;
+    bh.flags = streams ? BLOCK_STREAMS : 0;
+
+    uint32_t offset = sizeof(BlockHeader) + bh.table_size;
+    offset = block_write(buf, capacity, offset, src, n, streams, packed, codes, m);
+    bh.comp_size = offset - sizeof(BlockHeader);
+    free(m);
+    free(model);
+
+    memcpy(buf, &bh, sizeof(BlockHeader));
+    *size = sizeof(BlockHeader) + bh.comp_size;
+    return buf;
+}
+
+// Sets up readers over the STREAMS bitstreams in the nbytes of bits, which
+// start with the sizes of all but the last. Returns false if the sizes don't
+// fit.
+static bool block_readers(uint8_t *bits, uint32_t nbytes, BitReader readers[static STREAMS]) {
+    uint32_t offset = 4 * (STREAMS - 1);
+    uint32_t k = 0;
+    for (; k < STREAMS && offset <= nbytes; k++) {
+        uint32_t len = nbytes - offset; // The last stream takes the rest
+        if (k < STREAMS - 1) {
+            len = 0;
+            for (uint32_t j = 0; j < 4; j++) {
+                len |= (uint32_t) bits[4 * k + j] << (8 * j);
+            }
+        }
+        if (len > nbytes - offset) {
+            break;
+        }
+        bit_reader_init(&readers[k], NULL, bits + offset, len);
+        offset += len;
+    }
+    return k == STREAMS;
+}
+
+// Decompresses a BLOCK_CONTEXT block, as block_decode()
+static bool block_decode_context(BlockHeader *bh, uint8_t *data, uint8_t *dst) {
+    ContextModel *m = (ContextModel *) malloc(sizeof(ContextModel));
+    if (!m) {
+        return false;
+    }
+    if (!context_load(m, bh->table_size, data)) {
+        free(m);
+        return false;
+    }
+    DecodeTable *tables = (DecodeTable *) malloc(m->tables * sizeof(DecodeTable));
+    if (!tables) {
+        free(m);
+        return false;
+    }
+    for (uint32_t j = 0; j < m->tables; j++) {
+        table_build_canonical(&tables[j], m->lengths[j]);
+    }
+
+    // Streams start from a fresh context, so each is decoded on its own
+    uint8_t *bits = data + bh->table_size;
+    uint32_t nbytes = bh->comp_size - bh->table_size;
+    BitReader readers[STREAMS];
+    bool ok = true;
+    if (!(bh->flags & BLOCK_STREAMS)) {
+        bit_reader_init(&readers[0], NULL, bits, nbytes);
+        table_decode_context(tables, m->map, &readers[0], dst, bh->raw_size);
+    } else if ((ok = block_readers(bits, nbytes, readers))) {
+        uint64_t len = bh->raw_size / STREAMS;
+        for (uint32_t k = 0; k < STREAMS; k++) {
+            uint64_t count = k == STREAMS - 1 ? bh->raw_size - k * len : len;
+            table_decode_context(tables, m->map, &readers[k], dst + k * len, count);
+        }
+    }
+    free(tables);
+    free(m);
+    return ok;
+}
+
+//
+// Decompresses the block described by bh, whose block data is data, into
+// dst which must hold bh->raw_size bytes. Returns false if the block is
+// malformed or memory can't be allocated.
+//
+bool block_decode(BlockHeader *bh, uint8_t *data, uint8_t *dst) {
+    if (bh->type == BLOCK_STORED) {
+        if (bh->comp_size != bh->raw_size || bh->table_size != 0) {
+            return false;
+        }
+        memcpy(dst, data, bh->raw_size);
+        return true;
+    } else if (bh->type == BLOCK_RLE) {
+        if (bh->comp_size != 1 || bh->table_size != 0) {
+            return false;
+        }
+        memset(dst, data[0], bh->raw_size);
+        return true;
+    } else if (bh->table_size > bh->comp_size) {
+        return false;
+    } else if (bh->type == BLOCK_CONTEXT) {
+        return block_decode_context(bh, data, dst);
+    } else if (bh->type != BLOCK_HUFFMAN) {
+        return false;
+    }
+    uint8_t lengths[ALPHABET];
+    if (!lengths_load(bh->table_size, data, lengths)) {
+        return false;
+    }
+    DecodeTable *table = (DecodeTable *) malloc(sizeof(DecodeTable));
+    if (!table) {
+        return false;
+    }
+    table_build_canonical(table, lengths);
+
+    uint8_t *bits = data + bh->table_size;
+    uint32_t nbytes = bh->comp_size - bh->table_size;
+    if (!(bh->flags & BLOCK_STREAMS)) {
+        BitReader reader;
+        bit_reader_init(&reader, NULL, bits, nbytes);
+        table_decode(table, &reader, dst, bh->raw_size);
+        free(table);
+        return true;
+    }
+
+    // Check that the stream sizes fit in the block before reading any stream
+    BitReader readers[STREAMS];
+    if (!block_readers(bits, nbytes, readers)) {
+        free(table);
+        return false;
+    }
+    table_decode_streams(table, readers, dst, bh->raw_size);
+    free(table);
+    return true;
+}
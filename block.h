@@ -0,0 +1,20 @@
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include "defines.h"
+#include "header.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool block_plan(uint64_t hist[static ALPHABET], uint32_t n, uint8_t limit, bool streams,
+    uint8_t lengths[static ALPHABET], uint8_t table[static MAX_LENS_SIZE], uint16_t *table_size, uint8_t *type);
+
+uint32_t block_coded_size(
+    uint64_t parts[static STREAMS][ALPHABET], uint32_t n, uint8_t limit, bool streams, uint8_t *type);
+
+uint8_t *block_encode(uint8_t *src, uint32_t n, uint8_t limit, bool streams, uint32_t contexts, uint32_t *size);
+
+bool block_decode(BlockHeader *bh, uint8_t *data, uint8_t *dst);
+
+#endif
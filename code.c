@@ -90,3 +90,17 @@ void code_print(Code *c) {
 
     return;
 }
+
+// Packs a code into a single word. Only the length is kept for codes longer
+// than PACKED_BITS.
+PackedCode code_pack(Code *c) {
+    uint64_t bits = 0;
+    if (code_size(c) <= PACKED_BITS) {
+        for (uint32_t i = 0; i < PACKED_BITS / 8; i++) {
+            bits |= (uint64_t) c->bits[i] << (8 * i);
+        }
+        // Drop any stale bits above the top of the stack
+        bits &= (UINT64_C(1) << code_size(c)) - 1;
+    }
+    return ((PackedCode) code_size(c) << PACKED_BITS) | bits;
+}
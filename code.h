@@ -11,6 +11,16 @@ typedef struct Code {
     uint8_t bits[MAX_CODE_SIZE];
 } Code;
 
+//
+// A code packed into a single word for the encoder: the code bits, first bit
+// least significant, in the low PACKED_BITS bits and the code length in the
+// top 8 bits. Codes longer than PACKED_BITS only carry their length and must
+// be written from the full Code.
+//
+typedef uint64_t PackedCode;
+
+#define PACKED_BITS 56
+
 Code code_init(void);
 
 uint32_t code_size(Code *c);
@@ -25,4 +35,16 @@ bool code_pop_bit(Code *c, uint8_t *bit);
 
 void code_print(Code *c);
 
+PackedCode code_pack(Code *c);
+
+// Returns the length in bits of a packed code
+static inline uint32_t packed_length(PackedCode p) {
+    return (uint32_t) (p >> PACKED_BITS);
+}
+
+// Returns the code bits of a packed code
+static inline uint64_t packed_bits(PackedCode p) {
+    return p & ((UINT64_C(1) << PACKED_BITS) - 1);
+}
+
 #endif
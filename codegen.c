@@ -0,0 +1,338 @@
+#include "code.h"
+#include "defines.h"
+#include "dict.h"
+#include "histogram.h"
+#include "huffman.h"
+#include "io.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS     "hvl:d:D:n:o:"
+#define MAX_LIMIT   16 // Longest code a generated decode table resolves.
+#define DEFAULT_LIM 12 // Default code length limit, a 4096 entry decode table.
+#define PATH_SIZE   4096
+
+static void usage(char *exec) {
+    fprintf(stderr,
+        "SYNOPSIS\n"
+        "  A code generator.\n"
+        "  Emits a C source and header pair with static encode and decode tables\n"
+        "  and encode and decode functions unrolled for a fixed code table, so\n"
+        "  coding needs no table construction at runtime.\n"
+        "\n"
+        "USAGE\n"
+        "  %s [-h] [-v] [-l limit] [-d id] [-D dir] [-n name] [-o dir] [file ...]\n"
+        "\n"
+        "OPTIONS\n"
+        "  -h               Program usage and help.\n"
+        "  -v               Print statistics of the code table.\n"
+        "  -l limit         Code length limit for a corpus, 8 to %d (default: %d).\n"
+        "  -d id            Use trained dictionary id instead of a corpus.\n"
+        "  -D dir           Directory holding dictionaries (default: .).\n"
+        "  -n name          Prefix of the generated files and functions (default: huff_static).\n"
+        "  -o dir           Directory to write name.c and name.h in (default: .).\n"
+        "  file ...         Corpus files to build the code table from (default: stdin).\n",
+        exec, MAX_LIMIT, DEFAULT_LIM);
+    return;
+}
+
+// Returns true if name is a valid C identifier
+static bool valid_name(const char *name) {
+    if (!isalpha((unsigned char) name[0]) && name[0] != '_') {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!isalnum((unsigned char) *c) && *c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Adds the bytes of the corpus files files[0..count) to hist, or of stdin if
+// count is 0. Returns false on an open or read error.
+static bool count_corpus(uint64_t hist[static ALPHABET], char **files, int count) {
+    uint8_t *buf = (uint8_t *) malloc(READ_BUFFER);
+    if (!buf) {
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; ok && (i < count || (i == 0 && count == 0)); i++) {
+        int infile = count ? open(files[i], O_RDONLY) : STDIN_FILENO;
+        if (infile == -1) {
+            fprintf(stderr, "Error opening %s.\n", files[i]);
+            ok = false;
+            break;
+        }
+        int bytes = 0;
+        while ((bytes = read_bytes(infile, buf, READ_BUFFER)) > 0) {
+            histogram_add(hist, buf, bytes);
+        }
+        ok = bytes == 0;
+        if (!ok) {
+            fprintf(stderr, "Error reading %s.\n", count ? files[i] : "stdin");
+        }
+        if (infile != STDIN_FILENO) {
+            close(infile);
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+// Writes the header declaring the generated functions. Macros are prefixed
+// with guard, name in upper case.
+static void emit_header(FILE *f, const char *name, const char *guard, uint32_t id, uint8_t max_length) {
+    fprintf(f, "// Generated by codegen from code table %08" PRIx32 ". Do not edit.\n", id);
+    fprintf(f, "#ifndef __%s_H__\n#define __%s_H__\n\n", guard, guard);
+    fprintf(f, "#include <stddef.h>\n#include <stdint.h>\n\n");
+    fprintf(f, "#define %s_MAX_LENGTH %" PRIu8 " // Longest code in bits.\n", guard, max_length);
+    fprintf(f, "#define %s_BOUND(n) (((n) * %s_MAX_LENGTH + 7) / 8 + 8) // Room encode needs for n bytes.\n\n",
+        guard, guard);
+    fprintf(f, "// Codes the n bytes of src into dst, which must hold %s_BOUND(n) bytes.\n", guard);
+    fprintf(f, "// Returns the number of coded bytes.\n");
+    fprintf(f, "size_t %s_encode(const uint8_t *src, size_t n, uint8_t *dst);\n\n", name);
+    fprintf(f, "// Decodes n bytes from the nbytes of coded data at src into dst.\n");
+    fprintf(f, "void %s_decode(const uint8_t *src, size_t nbytes, uint8_t *dst, size_t n);\n\n", name);
+    fprintf(f, "#endif\n");
+    return;
+}
+
+// Writes the lines of one unrolled encode step for src[i + k]
+static void emit_encode_step(FILE *f, const char *name, const char *indent, uint32_t k) {
+    fprintf(f, "%sacc |= (uint64_t) %s_codes[src[i + %" PRIu32 "]] << count;\n", indent, name, k);
+    fprintf(f, "%scount += %s_lengths[src[i + %" PRIu32 "]];\n", indent, name, k);
+    return;
+}
+
+// Writes the lines of one unrolled decode step for dst[i + k]
+static void emit_decode_step(FILE *f, const char *name, const char *guard, const char *indent, uint32_t k) {
+    fprintf(f, "%se = %s_table[bits & %s_MASK];\n", indent, name, guard);
+    fprintf(f, "%sdst[i + %" PRIu32 "] = (uint8_t) e;\n", indent, k);
+    fprintf(f, "%sbits >>= e >> 8;\n", indent);
+    fprintf(f, "%scount -= e >> 8;\n", indent);
+    return;
+}
+
+//
+// Writes the source with the tables and coding functions for lengths, whose
+// longest code is max_length bits. Codes are written least significant bit
+// first like BitWriter, so the output matches the coded bits of encode -d.
+// Encode puts 56 / max_length codes between stores of its 64-bit
+// accumulator, and decode takes as many lookups per refill, each unrolled.
+// The decode table has an entry for every max_length bit index, so every
+// code is resolved in a single lookup. Returns false if memory runs out.
+//
+static bool emit_source(
+    FILE *f, const char *name, const char *guard, uint32_t id, uint8_t lengths[static ALPHABET], uint8_t max_length) {
+    Code codes[ALPHABET] = { 0 };
+    canonical_codes(lengths, codes);
+    uint32_t bits[ALPHABET];
+    for (int i = 0; i < ALPHABET; i++) {
+        PackedCode p = code_pack(&codes[i]);
+        bits[i] = (uint32_t) packed_bits(p);
+    }
+    uint32_t size = 1u << max_length;
+    uint16_t *table = (uint16_t *) calloc(size, sizeof(uint16_t));
+    if (!table) {
+        return false;
+    }
+    for (int i = 0; i < ALPHABET; i++) {
+        for (uint32_t j = 0; lengths[i] && j < size >> lengths[i]; j++) {
+            table[bits[i] | j << lengths[i]] = (uint16_t) (i | lengths[i] << 8);
+        }
+    }
+    uint32_t steps = 56 / max_length;
+
+    fprintf(f, "// Generated by codegen from code table %08" PRIx32 ". Do not edit.\n", id);
+    fprintf(f, "#include \"%s.h\"\n\n#include <string.h>\n\n", name);
+    fprintf(f, "#define %s_MASK %#" PRIx32 "u\n\n", guard, size - 1);
+
+    fprintf(f, "// Code of each byte, least significant bit first\n");
+    fprintf(f, "static const uint16_t %s_codes[256] = {", name);
+    for (int i = 0; i < ALPHABET; i++) {
+        fprintf(f, "%s0x%04" PRIx32 ",", i % 8 ? " " : "\n    ", bits[i]);
+    }
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "// Code length of each byte\n");
+    fprintf(f, "static const uint8_t %s_lengths[256] = {", name);
+    for (int i = 0; i < ALPHABET; i++) {
+        fprintf(f, "%s%2" PRIu8 ",", i % 16 ? " " : "\n    ", lengths[i]);
+    }
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "// Byte and code length (high byte) for each value of the next %" PRIu8 " bits\n", max_length);
+    fprintf(f, "static const uint16_t %s_table[%" PRIu32 "] = {", name, size);
+    for (uint32_t i = 0; i < size; i++) {
+        fprintf(f, "%s0x%04" PRIx16 ",", i % 8 ? " " : "\n    ", table[i]);
+    }
+    fprintf(f, "\n};\n\n");
+    free(table);
+
+    fprintf(f, "static inline uint64_t %s_load(const uint8_t *p) {\n", name);
+    fprintf(f, "    uint64_t word;\n    memcpy(&word, p, sizeof(word));\n");
+    fprintf(f, "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n");
+    fprintf(f, "    word = __builtin_bswap64(word);\n#endif\n    return word;\n}\n\n");
+    fprintf(f, "static inline void %s_store(uint8_t *p, uint64_t word) {\n", name);
+    fprintf(f, "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n");
+    fprintf(f, "    word = __builtin_bswap64(word);\n#endif\n");
+    fprintf(f, "    memcpy(p, &word, sizeof(word));\n}\n\n");
+
+    fprintf(f, "size_t %s_encode(const uint8_t *src, size_t n, uint8_t *dst) {\n", name);
+    fprintf(f, "    uint64_t acc = 0;\n    uint32_t count = 0;\n    size_t pos = 0;\n    size_t i = 0;\n");
+    fprintf(f, "    for (; i + %" PRIu32 " <= n; i += %" PRIu32 ") {\n", steps, steps);
+    for (uint32_t k = 0; k < steps; k++) {
+        emit_encode_step(f, name, "        ", k);
+    }
+    fprintf(f, "        %s_store(dst + pos, acc);\n", name);
+    fprintf(f, "        pos += count >> 3;\n        acc >>= count & ~7u;\n        count &= 7;\n    }\n");
+    fprintf(f, "    for (; i < n; i++) {\n");
+    emit_encode_step(f, name, "        ", 0);
+    fprintf(f, "        %s_store(dst + pos, acc);\n", name);
+    fprintf(f, "        pos += count >> 3;\n        acc >>= count & ~7u;\n        count &= 7;\n    }\n");
+    fprintf(f, "    if (count) {\n        %s_store(dst + pos, acc);\n        pos += 1;\n    }\n", name);
+    fprintf(f, "    return pos;\n}\n\n");
+
+    fprintf(f, "// Tops bits up to more than 56 bits from src, reading zeros past its end\n");
+    fprintf(f, "static inline void %s_refill(\n", name);
+    fprintf(f, "    const uint8_t *src, size_t nbytes, size_t *pos, uint64_t *bits, uint32_t *count) {\n");
+    fprintf(f, "    if (*pos + 8 <= nbytes) {\n");
+    fprintf(f, "        *bits |= %s_load(src + *pos) << *count;\n", name);
+    fprintf(f, "        *pos += (63 - *count) >> 3;\n        *count |= 56;\n        return;\n    }\n");
+    fprintf(f, "    for (; *count <= 56; *count += 8, *pos += 1) {\n");
+    fprintf(f, "        *bits |= (uint64_t) (*pos < nbytes ? src[*pos] : 0) << *count;\n    }\n}\n\n");
+
+    fprintf(f, "void %s_decode(const uint8_t *src, size_t nbytes, uint8_t *dst, size_t n) {\n", name);
+    fprintf(f, "    uint64_t bits = 0;\n    uint32_t count = 0;\n    size_t pos = 0;\n    size_t i = 0;\n");
+    fprintf(f, "    uint16_t e;\n");
+    fprintf(f, "    for (; i + %" PRIu32 " <= n; i += %" PRIu32 ") {\n", steps, steps);
+    fprintf(f, "        %s_refill(src, nbytes, &pos, &bits, &count);\n", name);
+    for (uint32_t k = 0; k < steps; k++) {
+        emit_decode_step(f, name, guard, "        ", k);
+    }
+    fprintf(f, "    }\n    for (; i < n; i++) {\n");
+    fprintf(f, "        %s_refill(src, nbytes, &pos, &bits, &count);\n", name);
+    emit_decode_step(f, name, guard, "        ", 0);
+    fprintf(f, "    }\n    return;\n}\n");
+    return true;
+}
+
+// Opens dir/name.ext for writing, or returns NULL
+static FILE *open_output(const char *dir, const char *name, const char *ext) {
+    char path[PATH_SIZE];
+    int n = snprintf(path, PATH_SIZE, "%s/%s.%s", dir, name, ext);
+    if (n <= 0 || n >= PATH_SIZE) {
+        return NULL;
+    }
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error opening %s.\n", path);
+    }
+    return f;
+}
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+    uint32_t limit = DEFAULT_LIM;
+    bool dict = false;
+    uint32_t dict_id = 0;
+    const char *dict_dir = ".";
+    const char *name = "huff_static";
+    const char *out_dir = ".";
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': usage(argv[0]); return EXIT_SUCCESS;
+        case 'v': verbose = true; break;
+        case 'l':
+            limit = strtoul(optarg, NULL, 10);
+            if (limit < 8 || limit > MAX_LIMIT) {
+                fprintf(stderr, "Code length limit must be from 8 to %d bits.\n", MAX_LIMIT);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd': {
+            char *end = NULL;
+            dict = true;
+            dict_id = strtoul(optarg, &end, 16);
+            if (end == optarg || *end != '\0') {
+                fprintf(stderr, "Dictionary ID must be in hex.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'D': dict_dir = optarg; break;
+        case 'n': name = optarg; break;
+        case 'o': out_dir = optarg; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (!valid_name(name) || strlen(name) >= PATH_SIZE) {
+        fprintf(stderr, "Name must be a C identifier.\n");
+        return EXIT_FAILURE;
+    }
+    char guard[PATH_SIZE];
+    size_t n = 0;
+    for (; name[n]; n++) {
+        guard[n] = (char) toupper((unsigned char) name[n]);
+    }
+    guard[n] = '\0';
+
+    // The code table comes from a trained dictionary or is trained here
+    Dictionary d;
+    uint64_t hist[ALPHABET] = { 0 };
+    if (dict && !dict_load(&d, dict_dir, dict_id)) {
+        fprintf(stderr, "Failed to load dictionary %s/%08" PRIx32 ".dict.\n", dict_dir, dict_id);
+        return EXIT_FAILURE;
+    } else if (!dict) {
+        if (!count_corpus(hist, argv + optind, argc - optind)) {
+            fprintf(stderr, "Failed to read the corpus.\n");
+            return EXIT_FAILURE;
+        }
+        if (!dict_train(&d, hist, (uint8_t) limit)) {
+            fprintf(stderr, "Failed to limit code lengths to %" PRIu32 " bits.\n", limit);
+            return EXIT_FAILURE;
+        }
+    }
+    uint8_t max_length = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        max_length = d.lengths[i] > max_length ? d.lengths[i] : max_length;
+    }
+    if (max_length > MAX_LIMIT) {
+        fprintf(stderr, "Codes are longer than %d bits, train the dictionary with -l.\n", MAX_LIMIT);
+        return EXIT_FAILURE;
+    }
+
+    FILE *header = open_output(out_dir, name, "h");
+    FILE *source = header ? open_output(out_dir, name, "c") : NULL;
+    if (!header || !source) {
+        if (header) {
+            fclose(header);
+        }
+        return EXIT_FAILURE;
+    }
+    emit_header(header, name, guard, d.id, max_length);
+    bool ok = emit_source(source, name, guard, d.id, d.lengths, max_length);
+    ok = ok && !ferror(header) && !ferror(source);
+    ok = fclose(header) == 0 && ok;
+    ok = fclose(source) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s/%s.[ch].\n", out_dir, name);
+        return EXIT_FAILURE;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Code table: %08" PRIx32 "\n", d.id);
+        fprintf(stderr, "Longest code: %" PRIu8 " bits\n", max_length);
+        fprintf(stderr, "Decode table: %" PRIu32 " entries\n", 1u << max_length);
+        fprintf(stderr, "Symbols per refill: %d\n", 56 / max_length);
+    }
+    return EXIT_SUCCESS;
+}
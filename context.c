@@ -0,0 +1,242 @@
+#include "context.h"
+
+#include "huffman.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CONTEXT_ROUNDS 4 // Rounds of moving contexts to their cheapest table.
+#define MISSING_BITS   32 // Cost of a symbol a table has no code for.
+
+//
+// Counts how often each byte of src follows each other byte into pairs, as
+// the bytes are coded: the first byte of each stream follows a 0.
+//
+static void context_count(uint32_t (*pairs)[ALPHABET], uint8_t *src, uint32_t n, bool streams) {
+    uint32_t runs = streams ? STREAMS : 1;
+    for (uint32_t k = 0; k < runs; k++) {
+        uint32_t start = k * (n / runs);
+        uint32_t len = k == runs - 1 ? n - start : n / runs;
+        uint8_t prev = 0;
+        for (uint32_t i = start; i < start + len; i++) {
+            pairs[prev][src[i]] += 1;
+            prev = src[i];
+        }
+    }
+    return;
+}
+
+// Computes the code lengths of a table, limited to limit bits if limit is
+// not 0. A lone symbol is given a partner so that it still gets a code.
+// Returns false if the lengths can't be limited.
+static bool table_lengths(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET], uint8_t limit) {
+    uint64_t counts[ALPHABET];
+    uint32_t symbols = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        counts[i] = hist[i];
+        symbols += hist[i] != 0;
+    }
+    if (symbols < 2) {
+        counts[hist[0] ? 1 : 0] = 1;
+    }
+    optimal_lengths(counts, lengths);
+    return !limit || limit_lengths(counts, lengths, limit);
+}
+
+// Returns the bits taken to code the bytes counted in hist with lengths,
+// charging MISSING_BITS for bytes which have no code
+static uint64_t table_cost(uint32_t hist[static ALPHABET], uint8_t lengths[static ALPHABET]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        bits += (uint64_t) hist[i] * (lengths[i] ? lengths[i] : MISSING_BITS);
+    }
+    return bits;
+}
+
+//
+// Builds the model for coding the n bytes of src with at most tables code
+// tables (as split into STREAMS runs if streams is set), with codes limited
+// to limit bits if limit is not 0. Tables are seeded with the most frequent
+// contexts, then each context is moved to the table which codes it in the
+// fewest bits and the tables rebuilt, for CONTEXT_ROUNDS rounds. Returns the
+// number of coded bits, or UINT64_MAX if memory can't be allocated or the
+// code lengths can't be limited.
+//
+uint64_t context_plan(ContextModel *m, uint8_t *src, uint32_t n, uint32_t tables, uint8_t limit, bool streams) {
+    uint32_t (*pairs)[ALPHABET] = (uint32_t(*)[ALPHABET]) calloc(ALPHABET, sizeof(*pairs));
+    uint64_t (*hists)[ALPHABET] = (uint64_t(*)[ALPHABET]) calloc(MAX_CONTEXTS, sizeof(*hists));
+    if (!pairs || !hists) {
+        free(pairs);
+        free(hists);
+        return UINT64_MAX;
+    }
+    context_count(pairs, src, n, streams);
+
+    // List the contexts which occur, most frequent first
+    uint64_t totals[ALPHABET] = { 0 };
+    uint8_t order[ALPHABET];
+    uint32_t active = 0;
+    for (int c = 0; c < ALPHABET; c++) {
+        for (int i = 0; i < ALPHABET; i++) {
+            totals[c] += pairs[c][i];
+        }
+        if (totals[c]) {
+            uint32_t j = active++;
+            for (; j > 0 && totals[order[j - 1]] < totals[c]; j--) {
+                order[j] = order[j - 1];
+            }
+            order[j] = (uint8_t) c;
+        }
+    }
+    tables = tables < active ? tables : active;
+    tables = tables ? tables : 1;
+    memset(m->map, 0, sizeof(m->map));
+    for (uint32_t j = 0; j < tables && j < active; j++) {
+        m->map[order[j]] = (uint8_t) j;
+        for (int i = 0; i < ALPHABET; i++) {
+            hists[j][i] = pairs[order[j]][i];
+        }
+    }
+
+    bool ok = true;
+    for (uint32_t round = 0; ok && round < CONTEXT_ROUNDS; round++) {
+        for (uint32_t j = 0; ok && j < tables; j++) {
+            ok = table_lengths(hists[j], m->lengths[j], limit);
+        }
+
+        // Move every context to its cheapest table
+        for (uint32_t k = 0; k < active; k++) {
+            uint8_t c = order[k];
+            uint64_t best = UINT64_MAX;
+            for (uint32_t j = 0; j < tables; j++) {
+                uint64_t bits = table_cost(pairs[c], m->lengths[j]);
+                if (bits < best) {
+                    best = bits;
+                    m->map[c] = (uint8_t) j;
+                }
+            }
+        }
+
+        // Rebuild the histograms of the tables, dropping tables left empty
+        uint8_t renumber[MAX_CONTEXTS];
+        uint32_t used = 0;
+        memset(hists, 0, MAX_CONTEXTS * sizeof(*hists));
+        for (uint32_t j = 0; j < tables; j++) {
+            bool empty = true;
+            for (uint32_t k = 0; k < active && empty; k++) {
+                empty = m->map[order[k]] != j;
+            }
+            renumber[j] = (uint8_t) used;
+            used += !empty;
+        }
+        for (uint32_t k = 0; k < active; k++) {
+            uint8_t c = order[k];
+            m->map[c] = renumber[m->map[c]];
+            for (int i = 0; i < ALPHABET; i++) {
+                hists[m->map[c]][i] += pairs[c][i];
+            }
+        }
+        tables = used ? used : 1;
+    }
+
+    uint64_t bits = 0;
+    for (uint32_t j = 0; ok && j < tables; j++) {
+        ok = table_lengths(hists[j], m->lengths[j], limit);
+        bits += coded_bits(hists[j], m->lengths[j]);
+    }
+    m->tables = tables;
+    free(pairs);
+    free(hists);
+    return ok ? bits : UINT64_MAX;
+}
+
+//
+// Writes the model to buf and returns the number of bytes written (at most
+// MAX_CONTEXT_SIZE):
+//   1 byte: the number of tables T
+//   256 bytes: the table used after each byte, if T is more than 1
+//   Per table, 2 bytes: the size S of its code lengths (little endian)
+//   Per table, S bytes: its code lengths (see lengths_dump())
+//
+uint16_t context_dump(ContextModel *m, uint8_t *buf) {
+    uint16_t n = 0;
+    buf[n++] = (uint8_t) m->tables;
+    if (m->tables > 1) {
+        memcpy(buf + n, m->map, ALPHABET);
+        n += ALPHABET;
+    }
+    for (uint32_t j = 0; j < m->tables; j++) {
+        uint16_t size = lengths_dump(m->lengths[j], buf + n + 2);
+        buf[n] = (uint8_t) size;
+        buf[n + 1] = (uint8_t) (size >> 8);
+        n += 2 + size;
+    }
+    return n;
+}
+
+// Reads a model written by context_dump(). Returns false if the dump is
+// malformed.
+bool context_load(ContextModel *m, uint16_t nbytes, uint8_t buf[static nbytes]) {
+    uint16_t n = 0;
+    if (nbytes < 1 || buf[0] == 0 || buf[0] > MAX_CONTEXTS) {
+        return false;
+    }
+    m->tables = buf[n++];
+    memset(m->map, 0, sizeof(m->map));
+    if (m->tables > 1) {
+        if (nbytes - n < ALPHABET) {
+            return false;
+        }
+        memcpy(m->map, buf + n, ALPHABET);
+        n += ALPHABET;
+    }
+    for (int c = 0; c < ALPHABET; c++) {
+        if (m->map[c] >= m->tables) {
+            return false;
+        }
+    }
+    for (uint32_t j = 0; j < m->tables; j++) {
+        if (nbytes - n < 2) {
+            return false;
+        }
+        uint16_t size = buf[n] | (uint16_t) (buf[n + 1] << 8);
+        n += 2;
+        if (size > nbytes - n || !lengths_load(size, buf + n, m->lengths[j])) {
+            return false;
+        }
+        n += size;
+    }
+    return n == nbytes;
+}
+
+// Fills in the canonical codes of each table from their lengths
+void context_codes(ContextModel *m) {
+    for (uint32_t j = 0; j < m->tables; j++) {
+        memset(m->codes[j], 0, sizeof(m->codes[j]));
+        canonical_codes(m->lengths[j], m->codes[j]);
+        for (int i = 0; i < ALPHABET; i++) {
+            m->packed[j][i] = code_pack(&m->codes[j][i]);
+        }
+    }
+    return;
+}
+
+//
+// Writes the codes for the n bytes of src, each from the table of the byte
+// before it, starting from a 0. Like write_symbols(), w must have room for n
+// codes of the longest length.
+//
+void context_write(BitWriter *w, ContextModel *m, uint8_t *src, uint32_t n) {
+    uint8_t prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t table = m->map[prev];
+        PackedCode p = m->packed[table][src[i]];
+        if (packed_length(p) <= PACKED_BITS) {
+            bit_writer_put(w, packed_bits(p), packed_length(p));
+        } else {
+            bit_writer_put_code(w, &m->codes[table][src[i]]);
+        }
+        prev = src[i];
+    }
+    return;
+}
@@ -0,0 +1,40 @@
+#ifndef __CONTEXT_H__
+#define __CONTEXT_H__
+
+#include "code.h"
+#include "defines.h"
+#include "io.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Order-1 model for BLOCK_CONTEXT blocks: each byte is coded with one of
+// tables canonical code tables, picked by the byte before it. Contexts with
+// similar statistics are clustered onto the same table, which keeps the
+// block header small.
+//
+// tables: Number of code tables, 1 to MAX_CONTEXTS
+// map: Table used after each previous byte
+// lengths: Code lengths of each table
+// packed, codes: Codes of each table, filled in by context_codes()
+//
+typedef struct ContextModel {
+    uint32_t tables;
+    uint8_t map[ALPHABET];
+    uint8_t lengths[MAX_CONTEXTS][ALPHABET];
+    PackedCode packed[MAX_CONTEXTS][ALPHABET];
+    Code codes[MAX_CONTEXTS][ALPHABET];
+} ContextModel;
+
+uint64_t context_plan(ContextModel *m, uint8_t *src, uint32_t n, uint32_t tables, uint8_t limit, bool streams);
+
+uint16_t context_dump(ContextModel *m, uint8_t *buf);
+
+bool context_load(ContextModel *m, uint16_t nbytes, uint8_t buf[static nbytes]);
+
+void context_codes(ContextModel *m);
+
+void context_write(BitWriter *w, ContextModel *m, uint8_t *src, uint32_t n);
+
+#endif
@@ -1,9 +1,15 @@
 //#define DEBUG
 
+#include "backend.h"
+#include "block.h"
 #include "defines.h"
+#include "dict.h"
 #include "header.h"
 #include "huffman.h"
 #include "io.h"
+#include "pool.h"
+#include "stats.h"
+#include "table.h"
 
 #include <fcntl.h>
 #include <inttypes.h>
@@ -13,36 +19,355 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define OPTIONS "hvi:o:"
+#define OPTIONS "hvt:r:D:m:B:j:pi:o:"
 
 void print_help() {
     printf("SYNOPSIS\n");
     printf("  A Huffman decoder.\n");
     printf("  Decompresses a file using the Huffman coding algorithm.\n\n");
     printf("USAGE\n");
-    printf("  ./decode [-h] [-i infile] [-o outfile]\n\n");
+    printf("  ./decode [-h] [-v] [-t threads] [-r offset:length] [-D dir] [-m backend] [-B size]\n");
+    printf("           [-j file] [-p] [-i infile] [-o outfile]\n\n");
     printf("OPTIONS\n");
     printf("  -h             Program usage and help.\n");
     printf("  -v             Print compression statistics.\n");
+    printf("  -t threads     Decode blocks on threads threads; more than 1 also reads and\n");
+    printf("                 writes a single stream on their own threads (default: all CPUs).\n");
+    printf("  -r off:len     Decode only len bytes from offset off (len omitted: to the end).\n");
+    printf("  -D dir         Directory holding the dictionary of files coded with encode -d\n");
+    printf("                 (default: .).\n");
+    printf("  -m backend     I/O backend: read, pread, mmap or uring (default: read).\n");
+    printf("  -B size        I/O buffer size in KB (default: 64).\n");
+    printf("  -j file        Write per-phase stats as JSON to file (- for stderr).\n");
+    printf("  -p             Add hardware counters to the stats, where allowed.\n");
     printf("  -i infile      Input file to decompress.\n");
     printf("  -o outfile     Output of decompressed data.\n");
     return;
 }
 
-// Initialize global variables for tracking file sizes
-uint64_t bytes_read = 0;
-uint64_t bytes_written = 0;
+// Prints the compression statistics
+static void print_stats(uint64_t compressed_file_size, uint64_t decompressed_file_size) {
+    fprintf(stderr, "Compressed file size: %" PRIu64 " bytes \n", compressed_file_size);
+    fprintf(stderr, "Decompressed file size: %" PRIu64 " bytes \n", decompressed_file_size);
+
+    float space_saving = 1.0 - (compressed_file_size / (double) decompressed_file_size);
+    fprintf(stderr, "Space saving:  %.2f%% \n", 100.0 * space_saving);
+    return;
+}
+
+//
+// Decompresses the blocks of a block format file, after the file header has
+// been read, one block at a time. Returns the number of bytes decoded, or -1
+// if a block is malformed.
+//
+static int64_t decode_blocks(Input *input, Output *output) {
+    uint8_t *data = NULL;
+    uint8_t *out = NULL;
+    uint32_t data_size = 0;
+    uint32_t out_size = 0;
+    int64_t total = 0;
+    while (total >= 0) {
+        BlockHeader bh;
+        if (input_read(input, (uint8_t *) &bh, sizeof(BlockHeader)) != sizeof(BlockHeader)) {
+            total = -1;
+            break;
+        }
+        if (bh.raw_size == 0) {
+            break; // End of the blocks, the index and footer aren't needed
+        }
+        if (bh.raw_size > MAX_BLOCK) {
+            total = -1;
+            break;
+        }
+
+        // Grow the buffers to fit the block
+        if (bh.comp_size > data_size) {
+            free(data);
+            data_size = bh.comp_size;
+            data = (uint8_t *) malloc(data_size);
+        }
+        if (bh.raw_size > out_size) {
+            free(out);
+            out_size = bh.raw_size;
+            out = (uint8_t *) malloc(out_size);
+        }
+
+        if (bh.type == BLOCK_STORED && bh.comp_size == bh.raw_size) {
+            // Stored blocks are read straight into the output buffer
+            if (!out || input_read(input, out, bh.raw_size) != bh.raw_size) {
+                total = -1;
+                break;
+            }
+        } else if (!data || !out || input_read(input, data, bh.comp_size) != bh.comp_size
+                   || !block_decode(&bh, data, out)) {
+            total = -1;
+            break;
+        }
+        output_write(output, out, bh.raw_size);
+        total += bh.raw_size;
+    }
+    free(data);
+    free(out);
+    return total;
+}
+
+//
+// A block to be decoded on a worker thread. If out is NULL, the task writes
+// the decoded block straight to its place in outfile, base bytes past the
+// offset outfile was at, otherwise it leaves the decoded bytes in out.
+//
+typedef struct BlockTask {
+    int infile;
+    int outfile;
+    uint64_t base;
+    IndexEntry entry;
+    uint8_t *out;
+    bool ok;
+} BlockTask;
+
+//
+// Worker thread task for decoding a block. Stored blocks written straight to
+// outfile are copied from file to file without passing through memory.
+//
+static void decode_block_task(void *arg) {
+    BlockTask *task = (BlockTask *) arg;
+    BlockHeader bh;
+    uint64_t data_offset = task->entry.comp_offset + sizeof(BlockHeader);
+    task->ok = (uint64_t) pread_bytes(task->infile, (uint8_t *) &bh, sizeof(BlockHeader), task->entry.comp_offset)
+                   == sizeof(BlockHeader)
+               && bh.raw_size == task->entry.raw_size
+               && bh.comp_size + sizeof(BlockHeader) == task->entry.comp_size;
+    if (task->ok && !task->out && bh.type == BLOCK_STORED && bh.comp_size == bh.raw_size) {
+        task->ok = (uint64_t) pcopy_bytes(task->infile, data_offset, task->outfile,
+                       task->base + task->entry.raw_offset, task->entry.raw_size)
+                   == task->entry.raw_size;
+        return;
+    } else if (!task->ok) {
+        return;
+    }
+
+    uint8_t *data = (uint8_t *) malloc(bh.comp_size);
+    uint8_t *out = task->out ? task->out : (uint8_t *) malloc(task->entry.raw_size);
+    task->ok = data && out
+               && (uint64_t) pread_bytes(task->infile, data, bh.comp_size, data_offset) == bh.comp_size
+               && block_decode(&bh, data, out);
+    if (task->ok && !task->out) {
+        task->ok = (uint64_t) pwrite_bytes(
+                       task->outfile, out, task->entry.raw_size, task->base + task->entry.raw_offset)
+                   == task->entry.raw_size;
+    }
+
+    free(data);
+    if (!task->out) {
+        free(out);
+    }
+    return;
+}
+
+//
+// Reads and checks the footer and block index at the end of a block format
+// file. Returns the index, or NULL if it can't be read or is inconsistent.
+//
+static IndexEntry *read_index(int infile, uint64_t size, Footer *footer) {
+    if (size < sizeof(Header) + sizeof(Footer)
+        || (uint64_t) pread_bytes(infile, (uint8_t *) footer, sizeof(Footer), size - sizeof(Footer))
+               != sizeof(Footer)
+        || footer->magic != MAGIC_BLOCK
+        || footer->index_offset + (uint64_t) footer->blocks * sizeof(IndexEntry)
+               != size - sizeof(Footer)) {
+        return NULL;
+    }
+    IndexEntry *index = (IndexEntry *) malloc(footer->blocks * sizeof(IndexEntry) + 1);
+    if (!index
+        || (uint64_t) pread_bytes(infile, (uint8_t *) index, footer->blocks * sizeof(IndexEntry),
+               footer->index_offset)
+               != footer->blocks * sizeof(IndexEntry)) {
+        free(index);
+        return NULL;
+    }
+
+    // Blocks must tile the original file and lie before the index
+    uint64_t raw_offset = 0;
+    for (uint32_t i = 0; i < footer->blocks; i++) {
+        if (index[i].raw_offset != raw_offset || index[i].raw_size > MAX_BLOCK
+            || index[i].comp_size < sizeof(BlockHeader)
+            || index[i].comp_offset + index[i].comp_size > footer->index_offset) {
+            free(index);
+            return NULL;
+        }
+        raw_offset += index[i].raw_size;
+    }
+    if (raw_offset != footer->file_size) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+//
+// Decodes the len bytes at offset of a block format file, clamped to the end
+// of the file, through output. Only the blocks covering the range are read,
+// found by a binary search of the block index. Returns the number of
+// compressed bytes read, or -1 if a block can't be decoded.
+//
+static int64_t decode_range(
+    int infile, Output *output, Footer *footer, IndexEntry *index, uint64_t offset, uint64_t len) {
+    if (offset >= footer->file_size || len == 0) {
+        return 0;
+    }
+    len = len < footer->file_size - offset ? len : footer->file_size - offset;
+
+    // Find the last block starting at or before offset
+    uint32_t lo = 0;
+    uint32_t hi = footer->blocks;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index[mid].raw_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int64_t total = 0;
+    uint8_t *data = NULL;
+    uint8_t *out = NULL;
+    for (uint32_t i = lo; i < footer->blocks && index[i].raw_offset < offset + len; i++) {
+        IndexEntry *entry = &index[i];
+        free(data);
+        free(out);
+        data = (uint8_t *) malloc(entry->comp_size);
+        out = (uint8_t *) malloc(entry->raw_size);
+        BlockHeader *bh = (BlockHeader *) data;
+        if (!data || !out
+            || (uint64_t) pread_bytes(infile, data, entry->comp_size, entry->comp_offset) != entry->comp_size
+            || bh->raw_size != entry->raw_size || bh->comp_size + sizeof(BlockHeader) != entry->comp_size
+            || !block_decode(bh, data + sizeof(BlockHeader), out)) {
+            total = -1;
+            break;
+        }
+
+        // Write the part of the block inside the range
+        uint64_t start = offset > entry->raw_offset ? offset - entry->raw_offset : 0;
+        uint64_t end = offset + len - entry->raw_offset;
+        end = end < entry->raw_size ? end : entry->raw_size;
+        output_write(output, out + start, end - start);
+        total += entry->comp_size;
+    }
+    free(data);
+    free(out);
+    return total;
+}
+
+//
+// Decompresses a block format file using its block index, decoding blocks
+// in parallel on the pool. If outfile is a regular file not opened for
+// appending, each block is written directly to its offset past the current
+// one as soon as it is decoded, and the file offset is moved past the
+// decoded bytes at the end. Otherwise blocks are decoded in batches and
+// written out in order through output. Returns false if a block can't be
+// decoded.
+//
+static bool decode_blocks_parallel(
+    int infile, int outfile, Output *output, Footer *footer, IndexEntry *index, Pool *pool) {
+    struct stat outstat;
+    int flags = fcntl(outfile, F_GETFL);
+    off_t base = lseek(outfile, 0, SEEK_CUR);
+    uint64_t end = (uint64_t) base + footer->file_size;
+    bool direct = fstat(outfile, &outstat) == 0 && S_ISREG(outstat.st_mode) && flags != -1 && !(flags & O_APPEND)
+                  && base >= 0 && ((uint64_t) outstat.st_size >= end || ftruncate(outfile, end) == 0);
+
+    // Buffers for batches written through output only need to hold the
+    // largest block
+    uint32_t batch = direct ? footer->blocks : 2 * pool_threads(pool);
+    batch = batch < footer->blocks ? batch : footer->blocks;
+    uint32_t largest = 0;
+    for (uint32_t i = 0; i < footer->blocks && !direct; i++) {
+        largest = index[i].raw_size > largest ? index[i].raw_size : largest;
+    }
+    BlockTask *tasks = (BlockTask *) calloc(batch + 1, sizeof(BlockTask));
+    if (!tasks) {
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t i = 0; i < batch && !direct; i++) {
+        tasks[i].out = (uint8_t *) malloc(largest);
+        ok = ok && tasks[i].out;
+    }
+
+    for (uint32_t first = 0; ok && first < footer->blocks; first += batch) {
+        uint32_t k = footer->blocks - first < batch ? footer->blocks - first : batch;
+        for (uint32_t i = 0; i < k; i++) {
+            tasks[i].infile = infile;
+            tasks[i].outfile = outfile;
+            tasks[i].base = (uint64_t) base;
+            tasks[i].entry = index[first + i];
+            pool_submit(pool, decode_block_task, &tasks[i]);
+        }
+        pool_wait(pool);
+        for (uint32_t i = 0; i < k; i++) {
+            ok = ok && tasks[i].ok;
+            if (ok && !direct) {
+                output_write(output, tasks[i].out, tasks[i].entry.raw_size);
+            }
+        }
+    }
+
+    if (ok && direct) {
+        ok = lseek(outfile, end, SEEK_SET) == (off_t) end;
+    }
+
+    for (uint32_t i = 0; i < batch; i++) {
+        free(tasks[i].out);
+    }
+    free(tasks);
+    return ok;
+}
+
+// Writes out the per-phase stats, if they were asked for, and deletes them
+static void write_stats(Stats *stats, char *stats_name, uint64_t compressed_file_size, uint64_t decompressed_file_size) {
+    stats_set(stats, "bytes_in", compressed_file_size);
+    stats_set(stats, "bytes_out", decompressed_file_size);
+    if (!stats_write(stats, stats_name)) {
+        fprintf(stderr, "Failed to write stats to %s.\n", stats_name);
+    }
+    stats_delete(&stats);
+    return;
+}
+
+//
+// If pipelined is set, moves reading and writing onto threads of their own
+// so coding doesn't wait on I/O. Each side is started on its own, and one
+// which can't be started keeps running on the calling thread. Records in
+// stats which sides were pipelined.
+//
+static void pipeline_io(Input *input, Output *output, bool pipelined, Stats *stats) {
+    bool reading = pipelined && input_pipeline(input, PIPE_CHUNKS);
+    bool writing = pipelined && output_pipeline(output, PIPE_CHUNKS);
+    stats_set(stats, "pipelined_input", reading);
+    stats_set(stats, "pipelined_output", writing);
+    return;
+}
 
 int main(int argc, char *argv[]) {
     // Argument flags
     bool HELP = false;
     bool VERBOSE = false;
+    bool COUNTERS = false;
+    uint32_t threads = 0; // Worker threads for block files, 0 for all CPUs
+    bool RANGE = false;
+    uint64_t range_offset = 0; // First byte to decode with -r
+    uint64_t range_length = UINT64_MAX; // Bytes to decode with -r
+    const char *dict_dir = "."; // Directory holding dictionaries
+    Backend backend = BACKEND_READ;
+    uint32_t io_size = READ_BUFFER; // Bytes per read or write
 
     // Initialize default values
     char *infile_name = NULL;
     char *outfile_name = NULL;
+    char *stats_name = NULL;
     int infile = STDIN_FILENO;
-    int outfile = STDIN_FILENO;
+    int outfile = STDOUT_FILENO;
 
     // Process command line arguments
     int opt = 0;
@@ -50,6 +375,43 @@ int main(int argc, char *argv[]) {
         switch (opt) {
         case 'h': HELP = true; break;
         case 'v': VERBOSE = true; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'r': {
+            char *end = NULL;
+            RANGE = true;
+            range_offset = strtoull(optarg, &end, 10);
+            if (end == optarg || *end != ':') {
+                fprintf(stderr, "Range must be offset:length.\n");
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            range_length = *(end + 1) ? strtoull(end + 1, NULL, 10) : UINT64_MAX;
+            break;
+        }
+        case 'D': dict_dir = optarg; break;
+        case 'm':
+            if (!backend_parse(optarg, &backend)) {
+                fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'B':
+            io_size = 1024 * strtoul(optarg, NULL, 10);
+            if (io_size == 0 || io_size > MAX_BLOCK) {
+                fprintf(stderr, "I/O buffer size must be from 1 to %d KB.\n", MAX_BLOCK / 1024);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'j': stats_name = strdup(optarg); break;
+        case 'p': COUNTERS = true; break;
         case 'i': infile_name = strdup(optarg); break;
         case 'o': outfile_name = strdup(optarg); break;
         default: HELP = true; break;
@@ -61,6 +423,7 @@ int main(int argc, char *argv[]) {
         print_help();
         free(infile_name);
         free(outfile_name);
+        free(stats_name);
         return 0;
     }
 
@@ -70,6 +433,7 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Invalid file name!\n");
             free(infile_name);
             free(outfile_name);
+            free(stats_name);
             exit(1);
         }
     }
@@ -82,14 +446,39 @@ int main(int argc, char *argv[]) {
         fchmod(outfile, statbuf.st_mode);
     }
 
+    // Stats are only kept if asked for, all stats calls do nothing on NULL
+    Stats *stats = stats_name ? stats_create("decode", COUNTERS) : NULL;
+
+    // All file data goes through the chosen I/O backend
+    Input *input = input_create(infile, backend, io_size);
+    Output *output = output_create(outfile, backend, io_size);
+    if (!input || !output) {
+        fprintf(stderr, "Failed to set up I/O.\n");
+        stats_delete(&stats);
+        input_delete(&input);
+        output_delete(&output);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        exit(1);
+    }
+
+    stats_set_str(stats, "backend", backend_name(input_backend(input)));
+
     // Process header from infile
-    Header header;
-    read_bytes(infile, (uint8_t *) &header, sizeof(Header));
+    stats_begin(stats, "header");
+    Header header = { 0 };
+    input_read(input, (uint8_t *) &header, sizeof(Header));
 
-    if (header.magic != MAGIC) {
+    if (header.magic != MAGIC && header.magic != MAGIC_CANON && header.magic != MAGIC_BLOCK
+        && header.magic != MAGIC_DICT) {
         fprintf(stderr, "Invalid magic number.\n");
+        stats_delete(&stats);
+        input_delete(&input);
+        output_delete(&output);
         free(infile_name);
         free(outfile_name);
+        free(stats_name);
         exit(1);
     }
 #ifdef DEBUG
@@ -100,58 +489,178 @@ int main(int argc, char *argv[]) {
     printf("File size: %" PRIu64 " bytes\n\n", header.file_size); // Uncompressed file size
 #endif
 
-    // Store tree dump in array
-    uint8_t *tree_dump = (uint8_t *) calloc(header.tree_size, sizeof(uint8_t));
-    read_bytes(infile, tree_dump, header.tree_size);
-    // Reconstruct tree from tree dump
-    Node *root = rebuild_tree(header.tree_size, tree_dump);
-
-    // Buffer for storing decoded symbols to eventually write out
-    uint8_t *out_buf = (uint8_t *) calloc(header.file_size, sizeof(uint8_t));
-
-    // Read in bits of input file and decode by traversing tree
-    uint8_t bit;
-    Node *curr_node = root; // Keep track of current node in tree
-    uint32_t symbols_written = 0; // Keep track of how many symbols we've written to buffer
-    while (true) {
-        // Read in bit
-        read_bit(infile, &bit);
-
-        // Traverse tree
-        if (bit) {
-            curr_node = curr_node->right;
+    // Only block format files can be decoded from the middle
+    if (RANGE && header.magic != MAGIC_BLOCK) {
+        fprintf(stderr, "Range decoding needs a block format file.\n");
+        stats_delete(&stats);
+        input_delete(&input);
+        output_delete(&output);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        exit(1);
+    }
+
+    // Block format files carry a code table per block
+    if (header.magic == MAGIC_BLOCK) {
+        stats_set_str(stats, "mode", "block");
+        stats_begin(stats, "decode");
+        // Seekable input can be decoded in parallel using the block index,
+        // otherwise read the blocks in order
+        Footer footer;
+        IndexEntry *index = NULL;
+        if (S_ISREG(statbuf.st_mode)) {
+            index = read_index(infile, statbuf.st_size, &footer);
+        }
+        int64_t file_size = -1;
+        uint64_t compressed_file_size = 0;
+        if (RANGE && !index) {
+            fprintf(stderr, "Range decoding needs a seekable file with a block index.\n");
+            stats_delete(&stats);
+            input_delete(&input);
+            output_delete(&output);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        } else if (RANGE) {
+            stats_set_str(stats, "mode", "range");
+            int64_t read = decode_range(infile, output, &footer, index, range_offset, range_length);
+            if (read >= 0) {
+                compressed_file_size = read;
+                file_size = output_bytes(output);
+            }
+            free(index);
+        } else if (index) {
+            stats_set(stats, "threads", threads ? threads : default_threads());
+            Pool *pool = pool_create(threads ? threads : default_threads());
+            if (pool && decode_blocks_parallel(infile, outfile, output, &footer, index, pool)) {
+                file_size = footer.file_size;
+            }
+            pool_delete(&pool);
+            free(index);
+            compressed_file_size = statbuf.st_size;
         } else {
-            curr_node = curr_node->left;
+            file_size = decode_blocks(input, output);
+            compressed_file_size = input_bytes(input);
         }
-
-        // Check if we are at leaf
-        if ((curr_node->left == NULL) || (curr_node->right == NULL)) {
-            out_buf[symbols_written] = curr_node->symbol; // Write symbol to buffer
-            symbols_written += 1;
-            curr_node = root; // Set node back to root
+        stats_begin(stats, "flush");
+        input_delete(&input);
+        output_delete(&output);
+        if (file_size < 0) {
+            fprintf(stderr, "Invalid block.\n");
+            stats_delete(&stats);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        }
+        if (VERBOSE) {
+            print_stats(compressed_file_size, file_size);
         }
+        write_stats(stats, stats_name, compressed_file_size, file_size);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        return 0;
+    }
 
-        // Check if we're done writing
-        if (symbols_written == header.file_size) {
-            break;
+    // Store tree dump (or code lengths for canonical codes) in array
+    uint8_t *tree_dump = (uint8_t *) calloc(header.tree_size, sizeof(uint8_t));
+    input_read(input, tree_dump, header.tree_size);
+
+    // Build the decode table. Canonical codes are rebuilt from their lengths
+    // alone, otherwise the tree is reconstructed from the tree dump. Files
+    // coded with a dictionary name it by ID in place of a tree dump.
+    stats_set_str(stats, "mode",
+        header.magic == MAGIC_DICT ? "dict" : header.magic == MAGIC_CANON ? "canonical" : "tree");
+    stats_begin(stats, "table");
+    DecodeTable *table = (DecodeTable *) malloc(sizeof(DecodeTable));
+    FlatTree *tree = NULL;
+    if (header.magic == MAGIC_DICT) {
+        uint8_t id[4] = { 0 };
+        input_read(input, id, sizeof(id));
+        uint32_t dict_id = id[0] | (uint32_t) id[1] << 8 | (uint32_t) id[2] << 16 | (uint32_t) id[3] << 24;
+        Dictionary dict;
+        if (!dict_load(&dict, dict_dir, dict_id)) {
+            fprintf(stderr, "Failed to load dictionary %s/%08" PRIx32 ".dict.\n", dict_dir, dict_id);
+            stats_delete(&stats);
+            input_delete(&input);
+            output_delete(&output);
+            free(table);
+            free(tree_dump);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        }
+        table_build_canonical(table, dict.lengths);
+    } else if (header.magic == MAGIC_CANON) {
+        uint8_t lengths[ALPHABET];
+        if (!lengths_load(header.tree_size, tree_dump, lengths)) {
+            fprintf(stderr, "Invalid code lengths.\n");
+            stats_delete(&stats);
+            input_delete(&input);
+            output_delete(&output);
+            free(table);
+            free(tree_dump);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
         }
+        table_build_canonical(table, lengths);
+    } else {
+        tree = rebuild_flat_tree(header.tree_size, tree_dump);
+        if (!tree) {
+            fprintf(stderr, "Invalid tree dump.\n");
+            stats_delete(&stats);
+            input_delete(&input);
+            output_delete(&output);
+            free(table);
+            free(tree_dump);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        }
+        table_build(table, tree);
     }
-    write_bytes(outfile, out_buf, header.file_size); // Write buffer out to file
+
+    // Decode symbols a table lookup at a time into a fixed size output
+    // buffer, which is written out each time it fills. Memory use doesn't
+    // depend on the file size and output starts right away. With CPUs to
+    // spare, reading and writing run on their own threads, overlapping the
+    // decoding.
+    stats_begin(stats, "decode");
+    pipeline_io(input, output, (threads ? threads : default_threads()) > 1, stats);
+    uint8_t *out_buf = (uint8_t *) malloc(WRITE_BUFFER);
+    BitReader reader;
+    bit_reader_init(&reader, input, NULL, 0);
+    for (uint64_t remaining = header.file_size; remaining > 0;) {
+        uint32_t n = remaining < WRITE_BUFFER ? remaining : WRITE_BUFFER;
+        table_decode(table, &reader, out_buf, n);
+        output_write(output, out_buf, n);
+        remaining -= n;
+    }
+    uint64_t compressed_file_size = input_bytes(input);
+    stats_begin(stats, "flush");
+    input_delete(&input);
+    output_delete(&output);
+    write_stats(stats, stats_name, compressed_file_size, header.file_size);
 
     // Print statistics
     if (VERBOSE) {
-        fprintf(stderr, "Compressed file size: %" PRIu64 " bytes \n", bytes_read);
-        fprintf(stderr, "Decompressed file size: %" PRIu64 " bytes \n", header.file_size);
-
-        float space_saving = 1.0 - (bytes_read / (double) header.file_size);
-        fprintf(stderr, "Space saving:  %.2f%% \n", 100.0 * space_saving);
+        print_stats(compressed_file_size, header.file_size);
     }
 
     // Free everything
-    delete_tree(&root);
+    delete_flat_tree(&tree);
+    free(table);
     free(tree_dump);
     free(out_buf);
     free(infile_name);
     free(outfile_name);
+    free(stats_name);
     return 0;
 }
@@ -4,7 +4,27 @@
 #define BLOCK         4096 // 4KB blocks.
 #define ALPHABET      256 // ASCII + Extended ASCII.
 #define MAGIC         0xDEADBEEF // 32-bit magic number.
+#define MAGIC_CANON   0xDEADC0DE // Magic number for canonical code files.
+#define MAGIC_BLOCK   0xDEADB10C // Magic number for block format files.
+#define MAGIC_DICT    0xDEADD1C7 // Magic number for files coded with a trained dictionary.
+#define MAGIC_TRAINED 0xD1C7F11E // Magic number for trained dictionary files.
 #define MAX_CODE_SIZE (ALPHABET / 8) // Bytes for a maximum, 256-bit code.
 #define MAX_TREE_SIZE (3 * ALPHABET - 1) // Maximum Huffman tree dump size.
+#define MAX_LENS_SIZE (2 * ALPHABET) // Maximum code length dump size.
+#define READ_BUFFER   (16 * BLOCK) // 64KB buffer for bit-level reads.
+#define WRITE_BUFFER  (16 * BLOCK) // 64KB buffer for decoded output.
+#define PIPE_CHUNKS   8 // I/O chunks queued between pipelined reader, coder and writer threads.
+#define DECODE_BITS   11 // Bits resolved per decode table lookup.
+#define MULTI_SYMBOLS 6 // Most symbols resolved per multi-symbol lookup.
+#define BLOCK_SIZE    (1 << 20) // Default 1MB of input per independently coded block.
+#define MAX_BLOCK     (1 << 26) // Largest block size allowed, 64MB.
+#define BLOCK_HUFFMAN 0 // Block type for canonical Huffman coded blocks.
+#define BLOCK_STORED  1 // Block type for blocks stored as is.
+#define BLOCK_RLE     2 // Block type for blocks of a single repeated symbol.
+#define BLOCK_CONTEXT 3 // Block type for blocks coded with order-1 context tables.
+#define BLOCK_STREAMS 0x01 // Block flag for coded bits split into STREAMS bitstreams.
+#define STREAMS       4 // Bitstreams per block decoded side by side.
+#define MAX_CONTEXTS  16 // Most code tables in a BLOCK_CONTEXT block.
+#define MAX_CONTEXT_SIZE (1 + ALPHABET + MAX_CONTEXTS * (2 + MAX_LENS_SIZE)) // Maximum context model dump size.
 
 #endif
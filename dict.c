@@ -0,0 +1,118 @@
+#include "dict.h"
+
+#include "huffman.h"
+#include "io.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+//
+// Dictionary files are named by their ID in hex, <id>.dict, and hold:
+//   4 bytes: MAGIC_TRAINED
+//   4 bytes: the ID
+//   2 bytes: the size S of the code lengths
+//   S bytes: the code lengths (see lengths_dump())
+// all little endian.
+//
+#define DICT_HEADER 10
+#define DICT_PATH   4096
+
+// Returns the 32-bit FNV-1a hash of the code lengths, used as the ID
+static uint32_t dict_id(uint8_t lengths[static ALPHABET]) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < ALPHABET; i++) {
+        hash = (hash ^ lengths[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Writes the path of dictionary id in dir to path. Returns false if it is too
+// long.
+static bool dict_path(char path[static DICT_PATH], const char *dir, uint32_t id) {
+    int n = snprintf(path, DICT_PATH, "%s/%08" PRIx32 ".dict", dir, id);
+    return n > 0 && n < DICT_PATH;
+}
+
+//
+// Builds the code lengths of d from the corpus histogram hist, limited to
+// limit bits if limit is not 0. Each count is raised by one so that bytes
+// missing from the corpus still get a code. Returns false if the lengths
+// can't be limited.
+//
+bool dict_train(Dictionary *d, uint64_t hist[static ALPHABET], uint8_t limit) {
+    uint64_t counts[ALPHABET];
+    for (int i = 0; i < ALPHABET; i++) {
+        counts[i] = hist[i] + 1;
+    }
+    optimal_lengths(counts, d->lengths);
+    if (limit && !limit_lengths(counts, d->lengths, limit)) {
+        return false;
+    }
+    d->id = dict_id(d->lengths);
+    return true;
+}
+
+// Writes d to its dictionary file in dir. Returns false if the file can't be
+// written.
+bool dict_save(Dictionary *d, const char *dir) {
+    char path[DICT_PATH];
+    if (!dict_path(path, dir, d->id)) {
+        return false;
+    }
+    uint8_t buf[DICT_HEADER + MAX_LENS_SIZE];
+    uint16_t size = lengths_dump(d->lengths, buf + DICT_HEADER);
+    for (uint32_t j = 0; j < 4; j++) {
+        buf[j] = (uint8_t) (MAGIC_TRAINED >> (8 * j));
+        buf[4 + j] = (uint8_t) (d->id >> (8 * j));
+    }
+    buf[8] = (uint8_t) size;
+    buf[9] = (uint8_t) (size >> 8);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = write_bytes(fd, buf, DICT_HEADER + size) == DICT_HEADER + size;
+    return close(fd) == 0 && ok;
+}
+
+//
+// Reads dictionary id from its file in dir into d. Returns false if the file
+// can't be read, is malformed, doesn't match id or leaves a byte without a
+// code.
+//
+bool dict_load(Dictionary *d, const char *dir, uint32_t id) {
+    char path[DICT_PATH];
+    if (!dict_path(path, dir, id)) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    uint8_t buf[DICT_HEADER + MAX_LENS_SIZE + 1];
+    int n = read_bytes(fd, buf, sizeof(buf));
+    close(fd);
+    if (n < DICT_HEADER) {
+        return false;
+    }
+    uint32_t magic = 0;
+    d->id = 0;
+    for (uint32_t j = 0; j < 4; j++) {
+        magic |= (uint32_t) buf[j] << (8 * j);
+        d->id |= (uint32_t) buf[4 + j] << (8 * j);
+    }
+    uint16_t size = buf[8] | (uint16_t) (buf[9] << 8);
+    if (magic != MAGIC_TRAINED || d->id != id || size != n - DICT_HEADER
+        || !lengths_load(size, buf + DICT_HEADER, d->lengths) || dict_id(d->lengths) != id) {
+        return false;
+    }
+    for (int i = 0; i < ALPHABET; i++) {
+        if (!d->lengths[i]) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef __DICT_H__
+#define __DICT_H__
+
+#include "defines.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// A code table trained ahead of time on a sample corpus and saved as a
+// dictionary file, so that inputs sharing its distribution can be coded in
+// a single pass with no code table of their own (see MAGIC_DICT). Every byte
+// has a code, so any input can be coded with any dictionary.
+//
+// id: Identifier of the dictionary, a hash of its code lengths
+// lengths: Canonical code lengths of the table
+//
+typedef struct Dictionary {
+    uint32_t id;
+    uint8_t lengths[ALPHABET];
+} Dictionary;
+
+bool dict_train(Dictionary *d, uint64_t hist[static ALPHABET], uint8_t limit);
+
+bool dict_save(Dictionary *d, const char *dir);
+
+bool dict_load(Dictionary *d, const char *dir, uint32_t id);
+
+#endif
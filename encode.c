@@ -1,12 +1,18 @@
 //#define DEBUG
 
+#include "backend.h"
+#include "block.h"
 #include "code.h"
 #include "defines.h"
+#include "dict.h"
 #include "header.h"
+#include "histogram.h"
 #include "huffman.h"
 #include "io.h"
 #include "node.h"
+#include "pool.h"
 #include "pq.h"
+#include "stats.h"
 
 #include <fcntl.h>
 #include <inttypes.h>
@@ -18,11 +24,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#define OPTIONS "hvi:o:"
-
-// Initialize global variables for tracking file sizes
-uint64_t bytes_read = 0;
-uint64_t bytes_written = 0;
+#define OPTIONS "hvcl:b:s:k:d:D:t:m:B:j:pi:o:"
 
 // Prints the program usage and help message
 static void print_help(void) {
@@ -31,11 +33,28 @@ static void print_help(void) {
     printf("  Compresses a file using the Huffman coding algorithm.\n");
     printf("\n");
     printf("USAGE\n");
-    printf("  ./encode [-h] [-i infile] [-o outfile]\n");
+    printf("  ./encode [-h] [-v] [-c] [-l limit] [-b size] [-s streams] [-k tables] [-d id] [-D dir]\n");
+    printf("           [-t threads] [-m backend] [-B size] [-j file] [-p] [-i infile] [-o outfile]\n");
     printf("\n");
     printf("OPTIONS\n");
     printf("  -h             Program usage and help.\n");
     printf("  -v             Print compression statistics.\n");
+    printf("  -c             Use canonical codes with a code length header.\n");
+    printf("  -l limit       Limit codes to at most limit bits (implies -c).\n");
+    printf("  -b size        Code independent blocks of size KB (default: 1024).\n");
+    printf("  -s streams     Bitstreams per block, 1 or %d (default: %d).\n", STREAMS, STREAMS);
+    printf("  -k tables      Code blocks with up to tables order-1 context tables, 2 to %d,\n", MAX_CONTEXTS);
+    printf("                 where smaller (default: off).\n");
+    printf("  -d id          Code with trained dictionary id, in a single pass with no code\n");
+    printf("                 table (see train).\n");
+    printf("  -D dir         Directory holding dictionaries (default: .).\n");
+    printf("  -t threads     Worker threads for encoding blocks and counting bytes; more than\n");
+    printf("                 1 also reads and writes a single stream on their own threads\n");
+    printf("                 (default: all CPUs).\n");
+    printf("  -m backend     I/O backend: read, pread, mmap or uring (default: read).\n");
+    printf("  -B size        I/O buffer size in KB (default: 64).\n");
+    printf("  -j file        Write per-phase stats as JSON to file (- for stderr).\n");
+    printf("  -p             Add hardware counters to the stats, where allowed.\n");
     printf("  -i infile      Input file to compress.\n");
     printf("  -o outfile     Output of compressed data.\n");
     return;
@@ -75,14 +94,271 @@ void print_codes(Code table[static ALPHABET]) {
     printf("\n");
 }
 
+// A block of input to be encoded on a worker thread, and the encoded result
+typedef struct BlockJob {
+    uint8_t *src;
+    uint32_t n;
+    uint8_t limit;
+    bool streams;
+    uint32_t contexts;
+    uint8_t *out;
+    uint32_t size;
+} BlockJob;
+
+// Worker thread task for encoding a block
+static void encode_block_task(void *arg) {
+    BlockJob *job = (BlockJob *) arg;
+    job->out = block_encode(job->src, job->n, job->limit, job->streams, job->contexts, &job->size);
+    return;
+}
+
+// Reads up to batch blocks of block_size bytes from input into jobs, setting
+// eof once the input runs out. Returns the number of blocks read.
+static uint32_t read_batch(Input *input, BlockJob *jobs, uint32_t batch, uint32_t block_size, bool *eof) {
+    uint32_t k = 0;
+    while (k < batch && !*eof) {
+        jobs[k].n = input_read(input, jobs[k].src, block_size);
+        *eof = jobs[k].n < block_size;
+        k += jobs[k].n > 0;
+    }
+    return k;
+}
+
+//
+// Compresses infile in the block format, after the file header has been
+// written. Blocks are read in batches, encoded in parallel on the pool and
+// written out in order, split into STREAMS bitstreams if streams is set and
+// with up to contexts order-1 code tables if contexts is more than 1.
+// Returns false if memory runs out.
+//
+static bool encode_blocks(Input *input, Output *output, uint32_t block_size, uint8_t limit, bool streams,
+    uint32_t contexts, Pool *pool) {
+    // A block per thread in each of two batches, so the next batch is read
+    // while the current one is encoded
+    uint32_t batch = pool_threads(pool);
+    BlockJob *jobs = (BlockJob *) calloc(2 * batch, sizeof(BlockJob));
+    if (!jobs) {
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t i = 0; i < 2 * batch; i++) {
+        jobs[i].src = (uint8_t *) malloc(block_size);
+        jobs[i].limit = limit;
+        jobs[i].streams = streams;
+        jobs[i].contexts = contexts;
+        ok = ok && jobs[i].src;
+    }
+
+    IndexEntry *index = NULL;
+    uint32_t blocks = 0;
+    uint32_t capacity = 0;
+    uint64_t comp_offset = sizeof(Header);
+    uint64_t raw_offset = 0;
+    bool eof = false;
+    BlockJob *current = jobs;
+    BlockJob *next = jobs + batch;
+    uint32_t k = ok ? read_batch(input, current, batch, block_size, &eof) : 0;
+    for (uint32_t i = 0; i < k; i++) {
+        pool_submit(pool, encode_block_task, &current[i]);
+    }
+    while (ok && k > 0) {
+        // Read the next batch while the current one is encoded, then submit it
+        uint32_t next_k = read_batch(input, next, batch, block_size, &eof);
+        pool_wait(pool);
+        for (uint32_t i = 0; i < next_k; i++) {
+            pool_submit(pool, encode_block_task, &next[i]);
+        }
+
+        // Write out the encoded blocks in order and index them
+        for (uint32_t i = 0; i < k; i++) {
+            if (blocks == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                IndexEntry *grown = (IndexEntry *) realloc(index, capacity * sizeof(IndexEntry));
+                if (!grown) {
+                    ok = false;
+                } else {
+                    index = grown;
+                }
+            }
+            if (ok && current[i].out) {
+                output_write(output, current[i].out, current[i].size);
+                index[blocks].comp_offset = comp_offset;
+                index[blocks].raw_offset = raw_offset;
+                index[blocks].comp_size = current[i].size;
+                index[blocks].raw_size = current[i].n;
+                comp_offset += current[i].size;
+                raw_offset += current[i].n;
+                blocks += 1;
+            }
+            ok = ok && current[i].out;
+            free(current[i].out);
+            current[i].out = NULL;
+        }
+        BlockJob *swap = current;
+        current = next;
+        next = swap;
+        k = next_k;
+    }
+
+    // Let a batch still in flight after a failure finish
+    pool_wait(pool);
+
+    if (ok) {
+        // Mark the end of the blocks, then write the index and footer
+        BlockHeader end = { 0 };
+        output_write(output, (uint8_t *) &end, sizeof(BlockHeader));
+        output_write(output, (uint8_t *) index, blocks * sizeof(IndexEntry));
+        Footer footer;
+        footer.index_offset = comp_offset + sizeof(BlockHeader);
+        footer.file_size = raw_offset;
+        footer.blocks = blocks;
+        footer.magic = MAGIC_BLOCK;
+        output_write(output, (uint8_t *) &footer, sizeof(Footer));
+    }
+
+    for (uint32_t i = 0; i < 2 * batch; i++) {
+        free(jobs[i].src);
+        free(jobs[i].out);
+    }
+    free(jobs);
+    free(index);
+    return ok;
+}
+
+// Writes the codes for the n bytes of src through writer to output, a
+// BLOCK of symbols at a time so the writer's buffer can't overflow
+static void encode_symbols(BitWriter *writer, Output *output, PackedCode packed[static ALPHABET],
+    Code codes[static ALPHABET], uint8_t *src, uint64_t n) {
+    for (uint64_t i = 0; i < n; i += BLOCK) {
+        write_symbols(writer, packed, codes, src + i, n - i < BLOCK ? n - i : BLOCK);
+        bit_writer_drain(writer, output);
+    }
+    return;
+}
+
+//
+// Compresses input with the codes of dictionary d, after a header holding
+// the ID of d in place of a code table, so the input is read only once. The
+// header needs the size of the input, so input of unknown size (size < 0)
+// is read into memory first. Returns false if memory runs out.
+//
+static bool encode_dict(Input *input, Output *output, Dictionary *d, uint16_t permissions, int64_t size) {
+    uint8_t *data = NULL;
+    uint8_t *buffer;
+    uint32_t bytes;
+    if (size < 0) {
+        uint64_t capacity = 0;
+        size = 0;
+        while ((bytes = input_next(input, &buffer)) != 0) {
+            if ((uint64_t) size + bytes > capacity) {
+                capacity = 2 * capacity > (uint64_t) size + bytes ? 2 * capacity : (uint64_t) size + bytes;
+                uint8_t *grown = (uint8_t *) realloc(data, capacity);
+                if (!grown) {
+                    free(data);
+                    return false;
+                }
+                data = grown;
+            }
+            memcpy(data + size, buffer, bytes);
+            size += bytes;
+        }
+    }
+
+    Header header;
+    header.magic = MAGIC_DICT;
+    header.permissions = permissions;
+    header.tree_size = 0;
+    header.file_size = size;
+    output_write(output, (uint8_t *) &header, sizeof(header));
+    uint8_t id[4];
+    for (uint32_t j = 0; j < 4; j++) {
+        id[j] = (uint8_t) (d->id >> (8 * j));
+    }
+    output_write(output, id, sizeof(id));
+
+    Code codes[ALPHABET] = { 0 };
+    PackedCode packed[ALPHABET];
+    canonical_codes(d->lengths, codes);
+    for (int i = 0; i < ALPHABET; i++) {
+        packed[i] = code_pack(&codes[i]);
+    }
+    uint8_t *out_buf = (uint8_t *) malloc(BLOCK * MAX_CODE_SIZE + 8);
+    if (!out_buf) {
+        free(data);
+        return false;
+    }
+    BitWriter writer;
+    bit_writer_init(&writer, out_buf, BLOCK * MAX_CODE_SIZE + 8);
+    if (data) {
+        encode_symbols(&writer, output, packed, codes, data, size);
+    } else {
+        while ((bytes = input_next(input, &buffer)) != 0) {
+            encode_symbols(&writer, output, packed, codes, buffer, bytes);
+        }
+    }
+    bit_writer_finish(&writer);
+    bit_writer_drain(&writer, output);
+    free(out_buf);
+    free(data);
+    return true;
+}
+
+// Prints the compression statistics
+static void print_stats(uint64_t uncompressed_file_size, uint64_t compressed_file_size) {
+    fprintf(stderr, "Uncompressed file size: %" PRIu64 " bytes \n", uncompressed_file_size);
+    fprintf(stderr, "Compressed file size: %" PRIu64 " bytes \n", compressed_file_size);
+
+    float space_saving = 1.0 - (compressed_file_size / (double) uncompressed_file_size);
+    fprintf(stderr, "Space saving:  %.2f%% \n", 100.0 * space_saving);
+    return;
+}
+
+// Writes out the per-phase stats, if they were asked for, and deletes them
+static void write_stats(Stats *stats, char *stats_name, uint64_t uncompressed_file_size, uint64_t compressed_file_size) {
+    stats_set(stats, "bytes_in", uncompressed_file_size);
+    stats_set(stats, "bytes_out", compressed_file_size);
+    if (!stats_write(stats, stats_name)) {
+        fprintf(stderr, "Failed to write stats to %s.\n", stats_name);
+    }
+    stats_delete(&stats);
+    return;
+}
+
+//
+// If pipelined is set, moves reading and writing onto threads of their own
+// so coding doesn't wait on I/O. Each side is started on its own, and one
+// which can't be started keeps running on the calling thread. Records in
+// stats which sides were pipelined.
+//
+static void pipeline_io(Input *input, Output *output, bool pipelined, Stats *stats) {
+    bool reading = pipelined && input_pipeline(input, PIPE_CHUNKS);
+    bool writing = pipelined && output_pipeline(output, PIPE_CHUNKS);
+    stats_set(stats, "pipelined_input", reading);
+    stats_set(stats, "pipelined_output", writing);
+    return;
+}
+
 int main(int argc, char *argv[]) {
     // Argument flags
     bool HELP = false;
     bool VERBOSE = false;
+    bool CANONICAL = false;
+    bool COUNTERS = false;
+    uint32_t limit = 0; // Maximum code length, 0 for no limit
+    uint32_t block_size = 0; // Bytes per block, 0 for a single stream
+    uint32_t streams = STREAMS; // Bitstreams per block
+    uint32_t contexts = 0; // Order-1 code tables per block, 0 for order-0 codes only
+    bool DICT = false;
+    uint32_t dict_id = 0; // Trained dictionary to code with
+    const char *dict_dir = "."; // Directory holding dictionaries
+    uint32_t threads = 0; // Worker threads, 0 for all CPUs
+    Backend backend = BACKEND_READ;
+    uint32_t io_size = READ_BUFFER; // Bytes per read or write
 
     // Initialize default values
     char *infile_name = NULL;
     char *outfile_name = NULL;
+    char *stats_name = NULL;
     int infile = STDIN_FILENO;
     int outfile = STDOUT_FILENO;
 
@@ -92,6 +368,84 @@ int main(int argc, char *argv[]) {
         switch (opt) {
         case 'h': HELP = true; break;
         case 'v': VERBOSE = true; break;
+        case 'c': CANONICAL = true; break;
+        case 'l':
+            CANONICAL = true;
+            limit = strtoul(optarg, NULL, 10);
+            if (limit < 8 || limit > PACKED_BITS) {
+                fprintf(stderr, "Code length limit must be from 8 to %d bits.\n", PACKED_BITS);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'b':
+            block_size = 1024 * strtoul(optarg, NULL, 10);
+            if (block_size == 0 || block_size > MAX_BLOCK) {
+                fprintf(stderr, "Block size must be from 1 to %d KB.\n", MAX_BLOCK / 1024);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 's':
+            streams = strtoul(optarg, NULL, 10);
+            if (streams != 1 && streams != STREAMS) {
+                fprintf(stderr, "Bitstreams per block must be 1 or %d.\n", STREAMS);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'k':
+            contexts = strtoul(optarg, NULL, 10);
+            if (contexts < 2 || contexts > MAX_CONTEXTS) {
+                fprintf(stderr, "Context tables per block must be from 2 to %d.\n", MAX_CONTEXTS);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'd': {
+            char *end = NULL;
+            DICT = true;
+            dict_id = strtoul(optarg, &end, 16);
+            if (end == optarg || *end != '\0') {
+                fprintf(stderr, "Dictionary ID must be in hex.\n");
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        }
+        case 'D': dict_dir = optarg; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'm':
+            if (!backend_parse(optarg, &backend)) {
+                fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'B':
+            io_size = 1024 * strtoul(optarg, NULL, 10);
+            if (io_size == 0 || io_size > MAX_BLOCK) {
+                fprintf(stderr, "I/O buffer size must be from 1 to %d KB.\n", MAX_BLOCK / 1024);
+                free(infile_name);
+                free(outfile_name);
+                free(stats_name);
+                exit(1);
+            }
+            break;
+        case 'j': stats_name = strdup(optarg); break;
+        case 'p': COUNTERS = true; break;
         case 'i': infile_name = strdup(optarg); break;
         case 'o': outfile_name = strdup(optarg); break;
         default: HELP = true; break;
@@ -103,15 +457,33 @@ int main(int argc, char *argv[]) {
         print_help();
         free(infile_name);
         free(outfile_name);
+        free(stats_name);
         return 0;
     }
 
+    // A dictionary replaces the per-file code table, which blocks each carry
+    Dictionary dict;
+    if (DICT && block_size) {
+        fprintf(stderr, "Dictionaries can't be used in block mode.\n");
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        exit(1);
+    } else if (DICT && !dict_load(&dict, dict_dir, dict_id)) {
+        fprintf(stderr, "Failed to load dictionary %s/%08" PRIx32 ".dict.\n", dict_dir, dict_id);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        exit(1);
+    }
+
     // If an input file name is suplied, open the file for reading
     if (infile_name != NULL) {
         if ((infile = open(infile_name, O_RDONLY)) == -1) {
             fprintf(stderr, "Invalid file name!\n");
             free(infile_name);
             free(outfile_name);
+            free(stats_name);
             exit(1);
         }
     }
@@ -124,25 +496,151 @@ int main(int argc, char *argv[]) {
         fchmod(outfile, statbuf.st_mode);
     }
 
+    // A single stream takes two passes over the input, so input which can't
+    // be rewound (pipes, sockets, terminals) is streamed in block mode, with
+    // each block coded by a table built from its own bytes. A dictionary
+    // needs no first pass.
+    off_t start = lseek(infile, 0, SEEK_CUR);
+    bool seekable = (S_ISREG(statbuf.st_mode) || S_ISBLK(statbuf.st_mode)) && start != -1;
+    if (!seekable && !block_size && !DICT) {
+        block_size = BLOCK_SIZE;
+        if (VERBOSE) {
+            fprintf(stderr, "Input is not seekable, encoding in blocks.\n");
+        }
+    }
+
+    // Stats are only kept if asked for, all stats calls do nothing on NULL
+    Stats *stats = stats_name ? stats_create("encode", COUNTERS) : NULL;
+
+    // All file data goes through the chosen I/O backend
+    Input *input = input_create(infile, backend, io_size);
+    Output *output = output_create(outfile, backend, io_size);
+    if (!input || !output) {
+        fprintf(stderr, "Failed to set up I/O.\n");
+        stats_delete(&stats);
+        input_delete(&input);
+        output_delete(&output);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        exit(1);
+    }
+    if (VERBOSE) {
+        fprintf(stderr, "I/O backend: %s \n", backend_name(input_backend(input)));
+    }
+    stats_set_str(stats, "backend", backend_name(input_backend(input)));
+    stats_set(stats, "threads", threads ? threads : default_threads());
+
+    // With CPUs to spare, single stream reading and writing run on their own
+    // threads, overlapping the coding
+    bool pipelined = (threads ? threads : default_threads()) > 1;
+
+    // Block mode codes independent blocks in parallel, in a single pass
+    if (block_size) {
+        stats_set_str(stats, "mode", "block");
+        stats_set(stats, "block_size", block_size);
+        stats_set(stats, "streams", streams);
+        stats_set(stats, "contexts", contexts);
+        stats_begin(stats, "encode");
+        Header header;
+        header.magic = MAGIC_BLOCK;
+        header.permissions = statbuf.st_mode;
+        header.tree_size = 0;
+        header.file_size = 0;
+        output_write(output, (uint8_t *) &header, sizeof(header));
+
+        Pool *pool = pool_create(threads ? threads : default_threads());
+        if (!pool || !encode_blocks(input, output, block_size, limit, streams == STREAMS, contexts, pool)) {
+            fprintf(stderr, "Failed to encode blocks.\n");
+            stats_delete(&stats);
+            pool_delete(&pool);
+            input_delete(&input);
+            output_delete(&output);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        }
+        pool_delete(&pool);
+        uint64_t uncompressed_file_size = input_bytes(input);
+        uint64_t compressed_file_size = output_bytes(output);
+        stats_begin(stats, "flush");
+        input_delete(&input);
+        output_delete(&output);
+
+        if (VERBOSE) {
+            print_stats(uncompressed_file_size, compressed_file_size);
+        }
+        write_stats(stats, stats_name, uncompressed_file_size, compressed_file_size);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        close(infile);
+        close(outfile);
+        return 0;
+    }
+
+    // A dictionary fixes the codes up front, so there is no histogram pass
+    if (DICT) {
+        stats_set_str(stats, "mode", "dict");
+        pipeline_io(input, output, pipelined, stats);
+        stats_begin(stats, "encode");
+        int64_t size = S_ISREG(statbuf.st_mode) && seekable ? statbuf.st_size - start : -1;
+        if (!encode_dict(input, output, &dict, statbuf.st_mode, size)) {
+            fprintf(stderr, "Failed to encode with dictionary.\n");
+            stats_delete(&stats);
+            input_delete(&input);
+            output_delete(&output);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        }
+        uint64_t uncompressed_file_size = input_bytes(input);
+        uint64_t compressed_file_size = output_bytes(output);
+        stats_begin(stats, "flush");
+        input_delete(&input);
+        output_delete(&output);
+
+        if (VERBOSE) {
+            print_stats(uncompressed_file_size, compressed_file_size);
+        }
+        write_stats(stats, stats_name, uncompressed_file_size, compressed_file_size);
+        free(infile_name);
+        free(outfile_name);
+        free(stats_name);
+        close(infile);
+        close(outfile);
+        return 0;
+    }
+
     // Histogram for storing # of occurences of each byte
+    stats_set_str(stats, "mode", CANONICAL ? "canonical" : "tree");
+    stats_begin(stats, "histogram");
     uint64_t histogram[ALPHABET] = { 0 };
     // Increment 0 and 255 so that min of two things are present
     histogram[0] += 1;
     histogram[255] += 1;
 
-    // Buffer for I/O
-    uint8_t buffer[BLOCK] = { 0 };
-
-    // Read in all bytes from input
-    int bytes;
-    while ((bytes = read_bytes(infile, buffer, BLOCK)) != 0) {
-
-        // Go through bytes read in, and increment histogram
-        for (int i = 0; i < bytes; i++) {
-            histogram[buffer[i]] += 1;
+    // Read in all bytes from input. A regular file is split into ranges
+    // counted in parallel straight from the file, anything else is counted
+    // as it is read through the input.
+    uint8_t *buffer;
+    uint32_t bytes;
+    uint64_t uncompressed_file_size = 0;
+    Pool *pool = NULL;
+    if (S_ISREG(statbuf.st_mode) && start >= 0 && start <= statbuf.st_size) {
+        pool = pool_create(threads ? threads : default_threads());
+    }
+    if (pool && histogram_file(histogram, infile, start, statbuf.st_size - start, pool)) {
+        uncompressed_file_size = statbuf.st_size - start;
+    } else {
+        while ((bytes = input_next(input, &buffer)) != 0) {
+            histogram_add(histogram, buffer, bytes); // Increment histogram
         }
+        uncompressed_file_size = input_bytes(input);
     }
-    uint64_t uncompressed_file_size = bytes_read; // Uncompressed file size is
+    pool_delete(&pool);
 
     // Go through histogram and figure out the number of unique symbols
     uint32_t unique_symbols = 0;
@@ -162,22 +660,52 @@ int main(int argc, char *argv[]) {
     printf("\n");
 #endif
 
-    // Build tree from histogram
-    Node *root = build_tree(histogram);
+    // Build tree from histogram. Canonical codes only need the code lengths,
+    // which are computed without a tree.
+    stats_begin(stats, "tree");
+    Node *root = CANONICAL ? NULL : build_tree(histogram);
 
     // Populate code table
     Code code_table[ALPHABET] = { 0 };
-    build_codes(root, code_table);
+    uint8_t lengths[ALPHABET] = { 0 };
+    uint64_t unlimited_bits = 0; // Size of the coded data before limiting code lengths
+    if (CANONICAL) {
+        optimal_lengths(histogram, lengths);
+        unlimited_bits = coded_bits(histogram, lengths);
+        if (limit && !limit_lengths(histogram, lengths, limit)) {
+            fprintf(stderr, "Failed to limit code lengths to %" PRIu32 " bits.\n", limit);
+            stats_delete(&stats);
+            input_delete(&input);
+            output_delete(&output);
+            free(infile_name);
+            free(outfile_name);
+            free(stats_name);
+            exit(1);
+        }
+        canonical_codes(lengths, code_table);
+    } else {
+        build_codes(root, code_table);
+    }
 #ifdef DEBUG
     print_codes(code_table);
 #endif
 
+    // Create buffer to store tree dump, or the code lengths for canonical codes
+    stats_begin(stats, "header");
+    uint8_t *tree_buf = (uint8_t *) calloc(MAX_TREE_SIZE, sizeof(uint8_t));
+
     // Create header
     Header header;
-    header.magic = MAGIC;
     header.permissions = statbuf.st_mode;
-    header.tree_size = (3 * unique_symbols) - 1;
-    header.file_size = bytes_read;
+    header.file_size = uncompressed_file_size;
+    if (CANONICAL) {
+        header.magic = MAGIC_CANON;
+        header.tree_size = lengths_dump(lengths, tree_buf);
+    } else {
+        header.magic = MAGIC;
+        header.tree_size = (3 * unique_symbols) - 1;
+        tree_dump(root, tree_buf); // Dump tree to buffer
+    }
 #ifdef DEBUG
     // Print header values
     printf("Header values\n");
@@ -187,41 +715,58 @@ int main(int argc, char *argv[]) {
     printf("File size: %" PRIu64 " bytes\n\n", header.file_size);
 #endif
 
-    write_bytes(outfile, (uint8_t *) &header, sizeof(header));
+    output_write(output, (uint8_t *) &header, sizeof(header));
 
-    // Create buffer to store tree dump
-    uint8_t *tree_buf = (uint8_t *) calloc(header.tree_size, sizeof(uint8_t));
-    tree_dump(root, tree_buf); // Dump tree to buffer
     // Write tree dump to outfile
-    write_bytes(outfile, tree_buf, header.tree_size);
+    output_write(output, tree_buf, header.tree_size);
 
-    // Start at beginning of infile and write out all of the codes
-    lseek(infile, 0, SEEK_SET);
-    bytes = 0;
-    while ((bytes = read_bytes(infile, buffer, BLOCK)) != 0) {
-        for (int i = 0; i < bytes; i++) {
-            Code *c = &code_table[buffer[i]];
-            write_code(outfile, c);
-        }
+    // Pack the code table so each symbol is written with a single word store
+    stats_begin(stats, "encode");
+    PackedCode packed_table[ALPHABET] = { 0 };
+    for (int i = 0; i < ALPHABET; i++) {
+        packed_table[i] = code_pack(&code_table[i]);
     }
-    flush_codes(outfile);
 
-    uint64_t compressed_file_size = bytes_written;
+    // Output buffer holds the codes for a full block of the longest possible codes
+    uint8_t *out_buf = (uint8_t *) malloc(BLOCK * MAX_CODE_SIZE + 8);
+    BitWriter writer;
+    bit_writer_init(&writer, out_buf, BLOCK * MAX_CODE_SIZE + 8);
+
+    // Start at beginning of infile and write out all of the codes
+    input_rewind(input);
+    pipeline_io(input, output, pipelined, stats);
+    while ((bytes = input_next(input, &buffer)) != 0) {
+        encode_symbols(&writer, output, packed_table, code_table, buffer, bytes);
+    }
+    bit_writer_finish(&writer);
+    bit_writer_drain(&writer, output);
+    uint64_t compressed_file_size = output_bytes(output);
+    stats_begin(stats, "flush");
+    input_delete(&input);
+    output_delete(&output);
+    write_stats(stats, stats_name, uncompressed_file_size, compressed_file_size);
 
     // Print statistics
     if (VERBOSE) {
-        fprintf(stderr, "Uncompressed file size: %" PRIu64 " bytes \n", uncompressed_file_size);
-        fprintf(stderr, "Compressed file size: %" PRIu64 " bytes \n", compressed_file_size);
+        print_stats(uncompressed_file_size, compressed_file_size);
 
-        float space_saving = 1.0 - (compressed_file_size / (double) uncompressed_file_size);
-        fprintf(stderr, "Space saving:  %.2f%% \n", 100.0 * space_saving);
+        if (limit) {
+            // Report how much limiting code lengths cost over optimal codes
+            uint64_t limited_bits = coded_bits(histogram, lengths);
+            fprintf(stderr, "Code length limit: %" PRIu32 " bits \n", limit);
+            fprintf(stderr, "Limit overhead: %" PRIu64 " bytes (%.3f%%) \n",
+                (limited_bits - unlimited_bits) / 8,
+                100.0 * (limited_bits - unlimited_bits) / (double) unlimited_bits);
+        }
     }
 
     // Deallocate memory and close file streams
     free(tree_buf);
+    free(out_buf);
     delete_tree(&root);
     free(infile_name);
     free(outfile_name);
+    free(stats_name);
     close(infile);
     close(outfile);
     return 0;
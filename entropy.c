@@ -1,67 +1,396 @@
+#include "block.h"
+#include "code.h"
+#include "defines.h"
+#include "header.h"
+#include "histogram.h"
+#include "huffman.h"
+#include "io.h"
+#include "pool.h"
+
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 #include <unistd.h>
 
 #define BYTE    256
 #define KBYTE   1024
-#define OPTIONS "h"
-
-static uint64_t number = 0, count[BYTE] = { 0 };
+#define OPTIONS "hvb:s:l:S:t:i:"
 
 static void usage(char *exec) {
     fprintf(stderr,
         "SYNOPSIS\n"
         "  A entropy measuring program.\n"
+        "  Estimates how well a file compresses without compressing it.\n"
         "\n"
         "USAGE\n"
-        "  %s < [input (reads from stdin)]\n"
+        "  %s [-h] [-v] [-b size] [-s streams] [-l limit] [-S percent] [-t threads] [-i infile]\n"
         "\n"
         "OPTIONS\n"
-        "  -h               Program usage and help.\n",
-        exec);
+        "  -h               Program usage and help.\n"
+        "  -v               Print statistics of each block.\n"
+        "  -b size          Block size in KB, as for encode -b (default: 1024).\n"
+        "  -s streams       Bitstreams per block, as for encode -s (default: %d).\n"
+        "  -l limit         Code length limit, as for encode -l.\n"
+        "  -S percent       Sample only percent of the blocks (default: 100).\n"
+        "  -t threads       Threads analysing blocks (default: all CPUs).\n"
+        "  -i infile        Input file to analyse (default: stdin).\n",
+        exec, STREAMS);
 }
 
-// Count the number of occurences of each byte value 0..255
-static void tally(int file) {
-    int length;
-    uint8_t buffer[KBYTE] = { 0 };
-    while ((length = read(file, buffer, KBYTE)) > 0) {
-        number += length;
-        for (int i = 0; i < length; i += 1) {
-            count[buffer[i]] += 1;
-        }
+//
+// A block analysed on a worker thread.
+//
+// src, n: The block's bytes
+// prev: The byte before the block, the context of its first byte
+// limit, streams: Coding options, as for block_encode()
+// parts: Histograms of the runs of the block coded as separate bitstreams
+// pairs: Order-1 counts, pairs[context][symbol], zeroed after merging
+// size, type: Size and type block_encode() would give the block
+//
+typedef struct BlockJob {
+    uint8_t *src;
+    uint32_t n;
+    uint8_t prev;
+    uint8_t limit;
+    bool streams;
+    uint64_t parts[STREAMS][ALPHABET];
+    uint32_t (*pairs)[ALPHABET];
+    uint32_t size;
+    uint8_t type;
+} BlockJob;
+
+//
+// Totals over every block analysed.
+//
+// hist: Order-0 counts
+// pairs: Order-1 counts, pairs[context][symbol]
+// bytes, blocks: Bytes and blocks analysed
+// coded: Total size of the blocks analysed once coded
+// types: Blocks analysed of each type
+//
+typedef struct Totals {
+    uint64_t hist[ALPHABET];
+    uint64_t pairs[ALPHABET][ALPHABET];
+    uint64_t bytes;
+    uint64_t blocks;
+    uint64_t coded;
+    uint64_t types[3];
+} Totals;
+
+static const char *type_names[] = { "huffman", "stored", "rle" };
+
+// Worker thread task counting both orders of a block and sizing it coded
+static void analyse_block_task(void *arg) {
+    BlockJob *job = (BlockJob *) arg;
+    memset(job->parts, 0, sizeof(job->parts));
+    for (uint32_t k = 0; k < STREAMS; k++) {
+        uint32_t start = k * (job->n / STREAMS);
+        uint32_t len = k == STREAMS - 1 ? job->n - start : job->n / STREAMS;
+        histogram_add(job->parts[k], job->src + start, len);
+    }
+    uint8_t prev = job->prev;
+    for (uint32_t i = 0; i < job->n; i++) {
+        job->pairs[prev][job->src[i]] += 1;
+        prev = job->src[i];
     }
+    job->size = block_coded_size(job->parts, job->n, job->limit, job->streams, &job->type);
     return;
 }
 
 //  ∞
 // -∑ Pr(x ) log (x )
 // i=1    i     2  i
-static double entropy(int file) {
-    tally(file);
+// Entropy in bits per symbol of the n symbols counted in hist
+static double entropy(uint64_t hist[static ALPHABET], uint64_t n) {
     double sum = 0.0;
     for (int i = 0; i < BYTE; i += 1) {
-        double p = (double) count[i] / (double) number;
+        double p = (double) hist[i] / (double) n;
         if (p > 0) {
-            sum += p * log2(p);
+            sum -= p * log2(p);
         }
     }
-    return -sum;
+    return sum;
+}
+
+// Conditional entropy in bits per symbol of the order-1 counts in pairs
+static double entropy_order1(uint64_t pairs[static ALPHABET][ALPHABET], uint64_t n) {
+    double sum = 0.0;
+    for (int c = 0; c < BYTE; c += 1) {
+        uint64_t contexts = 0;
+        for (int i = 0; i < BYTE; i += 1) {
+            contexts += pairs[c][i];
+        }
+        if (contexts) {
+            sum += entropy(pairs[c], contexts) * (double) contexts / (double) n;
+        }
+    }
+    return sum;
+}
+
+//
+// Adds a finished job, block index at offset, to the totals and zeroes its
+// order-1 counts. Only the rows of contexts which occur in the block can be
+// non-zero.
+//
+static void merge_block(Totals *t, BlockJob *job, uint64_t index, uint64_t offset, bool verbose) {
+    uint64_t hist[ALPHABET] = { 0 };
+    for (uint32_t k = 0; k < STREAMS; k++) {
+        for (int i = 0; i < ALPHABET; i++) {
+            hist[i] += job->parts[k][i];
+        }
+    }
+    bool rows[ALPHABET] = { false };
+    rows[job->prev] = true;
+    uint32_t symbols = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        t->hist[i] += hist[i];
+        rows[i] = rows[i] || hist[i];
+        symbols += hist[i] != 0;
+    }
+    for (int c = 0; c < ALPHABET; c++) {
+        if (rows[c]) {
+            for (int i = 0; i < ALPHABET; i++) {
+                t->pairs[c][i] += job->pairs[c][i];
+            }
+            memset(job->pairs[c], 0, sizeof(job->pairs[c]));
+        }
+    }
+    t->bytes += job->n;
+    t->blocks += 1;
+    t->coded += job->size;
+    t->types[job->type] += 1;
+    if (verbose) {
+        printf("Block %" PRIu64 ": offset %" PRIu64 ", %" PRIu32 " bytes, %u symbols, %.6lf bits/byte, %s, %" PRIu32
+               " bytes coded\n",
+            index, offset, job->n, symbols, entropy(hist, job->n), type_names[job->type], job->size);
+    }
+    return;
+}
+
+// Returns true if block i is one of percent of the blocks, spread evenly
+static bool sampled(uint64_t i, uint32_t percent) {
+    return i == 0 || (i * percent) / 100 != ((i - 1) * percent) / 100;
+}
+
+// Prints the coded size of a format and how much it saves over size bytes
+static void print_size(const char *name, uint64_t coded, uint64_t size, bool estimated) {
+    printf("%s size: %s%" PRIu64 " bytes (saving %.2f%%)\n", name, estimated ? "~" : "", coded,
+        size ? 100.0 * (1.0 - (double) coded / (double) size) : 0.0);
+    return;
+}
+
+//
+// Prints the entropy and the size each format of encode would give the size
+// bytes of input, extrapolated from the blocks analysed when sampling.
+// Single stream files code the totals' histogram with the extra 0 and 255
+// encode adds. Returns false if the code lengths can't be limited.
+//
+static bool print_report(Totals *t, uint64_t size, uint64_t blocks, uint32_t block_size, uint8_t limit) {
+    bool estimated = t->bytes != size;
+    double scale = t->bytes ? (double) size / (double) t->bytes : 0.0;
+    printf("Input size: %" PRIu64 " bytes in %" PRIu64 " blocks of %" PRIu32 " KB\n", size, blocks,
+        block_size / KBYTE);
+    if (estimated) {
+        printf("Sampled: %" PRIu64 " bytes in %" PRIu64 " blocks\n", t->bytes, t->blocks);
+    }
+    printf("Order-0 entropy: %lf bits/byte\n", t->bytes ? entropy(t->hist, t->bytes) : 0.0);
+    printf("Order-1 entropy: %lf bits/byte\n", t->bytes ? entropy_order1(t->pairs, t->bytes) : 0.0);
+
+    uint64_t hist[ALPHABET];
+    memcpy(hist, t->hist, sizeof(hist));
+    hist[0] += 1;
+    hist[255] += 1;
+    uint32_t unique_symbols = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        unique_symbols += hist[i] != 0;
+    }
+    uint8_t lengths[ALPHABET];
+    optimal_lengths(hist, lengths);
+    uint64_t bytes = (uint64_t) (scale * coded_bits(t->hist, lengths) / 8.0 + 0.999);
+    print_size("Tree", sizeof(Header) + 3 * unique_symbols - 1 + bytes, size, estimated);
+    if (limit) {
+        if (!limit_lengths(hist, lengths, limit)) {
+            return false;
+        }
+        bytes = (uint64_t) (scale * coded_bits(t->hist, lengths) / 8.0 + 0.999);
+    }
+    uint8_t table[MAX_LENS_SIZE];
+    print_size("Canonical", sizeof(Header) + lengths_dump(lengths, table) + bytes, size, estimated);
+
+    uint64_t coded = (uint64_t) (scale * t->coded + 0.5);
+    print_size("Block", sizeof(Header) + coded + sizeof(BlockHeader) + blocks * sizeof(IndexEntry) + sizeof(Footer),
+        size, estimated);
+    printf("Block types: %" PRIu64 " huffman, %" PRIu64 " stored, %" PRIu64 " rle\n", t->types[BLOCK_HUFFMAN],
+        t->types[BLOCK_STORED], t->types[BLOCK_RLE]);
+    return true;
 }
 
 int main(int argc, char **argv) {
+    bool verbose = false;
+    uint32_t block_size = BLOCK_SIZE;
+    uint32_t streams = STREAMS;
+    uint32_t limit = 0;
+    uint32_t percent = 100;
+    uint32_t threads = 0;
+    int infile = STDIN_FILENO;
+
     int opt = 0;
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 'h': usage(argv[0]); return EXIT_SUCCESS;
+        case 'v': verbose = true; break;
+        case 'b':
+            block_size = KBYTE * strtoul(optarg, NULL, 10);
+            if (block_size == 0 || block_size > MAX_BLOCK) {
+                fprintf(stderr, "Block size must be from 1 to %d KB.\n", MAX_BLOCK / KBYTE);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            streams = strtoul(optarg, NULL, 10);
+            if (streams != 1 && streams != STREAMS) {
+                fprintf(stderr, "Bitstreams per block must be 1 or %d.\n", STREAMS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            limit = strtoul(optarg, NULL, 10);
+            if (limit < 8 || limit > PACKED_BITS) {
+                fprintf(stderr, "Code length limit must be from 8 to %d bits.\n", PACKED_BITS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            percent = strtoul(optarg, NULL, 10);
+            if (percent == 0 || percent > 100) {
+                fprintf(stderr, "Sample percentage must be from 1 to 100.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'i':
+            if (infile != STDIN_FILENO) {
+                close(infile);
+            }
+            if ((infile = open(optarg, O_RDONLY)) == -1) {
+                fprintf(stderr, "Error opening %s.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         default: usage(argv[0]); return EXIT_FAILURE;
         }
     }
 
-    printf("%lf\n", entropy(STDIN_FILENO));
-    return 0;
+    // A regular file is mapped and its blocks analysed in place, anything
+    // else is read a block at a time
+    struct stat statbuf;
+    off_t start = lseek(infile, 0, SEEK_CUR);
+    uint64_t size = 0;
+    uint8_t *map = NULL;
+    if (fstat(infile, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && start >= 0 && start < statbuf.st_size) {
+        size = statbuf.st_size - start;
+        map = (uint8_t *) mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, infile, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            madvise(map, statbuf.st_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    Pool *pool = pool_create(threads ? threads : default_threads());
+    uint32_t batch = pool ? 2 * pool_threads(pool) : 0;
+    BlockJob *jobs = (BlockJob *) calloc(batch, sizeof(BlockJob));
+    uint64_t *offsets = (uint64_t *) calloc(batch, sizeof(uint64_t));
+    Totals *totals = (Totals *) calloc(1, sizeof(Totals));
+    bool ok = pool && jobs && offsets && totals;
+    for (uint32_t i = 0; ok && i < batch; i++) {
+        jobs[i].limit = limit;
+        jobs[i].streams = streams == STREAMS;
+        jobs[i].pairs = (uint32_t(*)[ALPHABET]) calloc(ALPHABET, sizeof(*jobs[i].pairs));
+        jobs[i].src = map ? NULL : (uint8_t *) malloc(block_size);
+        ok = jobs[i].pairs && (map || jobs[i].src);
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+    }
+
+    // Fill a batch with sampled blocks, analyse it on the pool, and merge
+    // the results in order
+    uint64_t offset = 0;
+    uint64_t blocks = 0;
+    uint8_t prev = 0;
+    bool eof = false;
+    bool limited = true; // Whether every code could be limited to limit bits
+    while (ok && limited && !eof) {
+        uint32_t k = 0;
+        while (k < batch && !eof) {
+            uint32_t n = 0;
+            if (map) {
+                n = size - offset < block_size ? size - offset : block_size;
+                jobs[k].src = map + start + offset;
+            } else {
+                int bytes = read_bytes(infile, jobs[k].src, block_size);
+                if (bytes < 0) {
+                    fprintf(stderr, "Error reading input.\n");
+                    ok = false;
+                    break;
+                }
+                n = bytes;
+            }
+            uint8_t *src = jobs[k].src;
+            eof = n < block_size;
+            if (n == 0) {
+                break;
+            }
+            if (sampled(blocks, percent)) {
+                jobs[k].n = n;
+                jobs[k].prev = prev;
+                offsets[k] = offset;
+                pool_submit(pool, analyse_block_task, &jobs[k]);
+                k += 1;
+            }
+            prev = src[n - 1];
+            offset += n;
+            blocks += 1;
+        }
+        pool_wait(pool);
+        for (uint32_t i = 0; limited && i < k; i++) {
+            limited = jobs[i].size != 0;
+            if (limited) {
+                merge_block(totals, &jobs[i], offsets[i] / block_size, offsets[i], verbose);
+            }
+        }
+    }
+
+    if (ok && limited) {
+        limited = print_report(totals, offset, blocks, block_size, limit);
+    }
+    if (ok && !limited) {
+        fprintf(stderr, "Failed to limit code lengths to %" PRIu32 " bits.\n", limit);
+    }
+
+    for (uint32_t i = 0; jobs && i < batch; i++) {
+        free(jobs[i].pairs);
+        if (!map) {
+            free(jobs[i].src);
+        }
+    }
+    if (map) {
+        munmap(map, statbuf.st_size);
+    }
+    free(jobs);
+    free(offsets);
+    free(totals);
+    pool_delete(&pool);
+    if (infile != STDIN_FILENO) {
+        close(infile);
+    }
+    return ok && limited ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -10,4 +10,58 @@ typedef struct Header {
     uint64_t file_size;
 } Header;
 
+//
+// Files in the block format (magic MAGIC_BLOCK) are laid out as:
+//
+//   Header (tree_size and file_size are 0)
+//   BlockHeader + block data, for each block
+//   BlockHeader with raw_size 0, marking the end of the blocks
+//   IndexEntry, for each block
+//   Footer
+//
+// Each block is coded independently with its own canonical code table, so
+// blocks can be encoded and decoded in parallel. For BLOCK_HUFFMAN blocks,
+// block data starts with table_size bytes of code lengths (see
+// lengths_dump()) followed by the coded bits, padded to a whole byte.
+//
+// Blocks which wouldn't shrink are BLOCK_STORED blocks, whose data is the
+// raw_size bytes of input. Blocks of a single repeated symbol are BLOCK_RLE
+// blocks, whose data is the one symbol. Neither has a code table, so
+// table_size is 0.
+//
+// BLOCK_CONTEXT blocks code each byte with one of several canonical code
+// tables, picked by the byte before it (0 for the first byte of each
+// bitstream). Their block data starts with table_size bytes of context model
+// (see context_dump()) in place of the code lengths.
+//
+// If flags has BLOCK_STREAMS set, the block's bytes are split into STREAMS
+// runs, the first STREAMS - 1 of raw_size / STREAMS bytes and the last taking
+// the rest, and each run is coded as its own bitstream. The coded bits are
+// then the sizes of the first STREAMS - 1 bitstreams, as 32-bit little endian
+// numbers, followed by each bitstream padded to a whole byte. Decoding the
+// streams side by side breaks the dependency of each code's position on the
+// length of the one before it.
+//
+typedef struct BlockHeader {
+    uint32_t raw_size;
+    uint32_t comp_size;
+    uint16_t table_size;
+    uint8_t type;
+    uint8_t flags;
+} BlockHeader;
+
+typedef struct IndexEntry {
+    uint64_t comp_offset;
+    uint64_t raw_offset;
+    uint32_t comp_size;
+    uint32_t raw_size;
+} IndexEntry;
+
+typedef struct Footer {
+    uint64_t index_offset;
+    uint64_t file_size;
+    uint32_t blocks;
+    uint32_t magic;
+} Footer;
+
 #endif
@@ -0,0 +1,142 @@
+#include "histogram.h"
+
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HIST_TABLES 4 // Number of interleaved counter tables
+#define HIST_CHUNK  (UINT64_C(1) << 31) // Bytes counted before 32-bit counters could overflow
+#define HIST_ALIGN  (1 << 20) // File ranges counted by each thread are multiples of 1MB
+#define HIST_READ   (1 << 20) // Bytes per read when a range can't be mapped
+
+//
+// Counts the bytes of buf into HIST_TABLES separate tables, so that runs of
+// the same byte increment different counters instead of each increment
+// waiting on the store of the one before. Input is loaded 16 bytes at a time
+// and bytes are spread across the tables in turn. The tables are summed into
+// hist at the end.
+//
+static void histogram_kernel(
+    uint64_t hist[static ALPHABET], const uint8_t *buf, uint64_t n) {
+    uint32_t counts[HIST_TABLES][ALPHABET];
+    memset(counts, 0, sizeof(counts));
+
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t lo = load_le64(buf + i);
+        uint64_t hi = load_le64(buf + i + 8);
+        for (int j = 0; j < 64; j += 8 * HIST_TABLES) {
+            counts[0][(lo >> j) & 0xff] += 1;
+            counts[1][(lo >> (j + 8)) & 0xff] += 1;
+            counts[2][(lo >> (j + 16)) & 0xff] += 1;
+            counts[3][(lo >> (j + 24)) & 0xff] += 1;
+            counts[0][(hi >> j) & 0xff] += 1;
+            counts[1][(hi >> (j + 8)) & 0xff] += 1;
+            counts[2][(hi >> (j + 16)) & 0xff] += 1;
+            counts[3][(hi >> (j + 24)) & 0xff] += 1;
+        }
+    }
+    for (; i < n; i++) {
+        counts[0][buf[i]] += 1;
+    }
+
+    for (int s = 0; s < ALPHABET; s++) {
+        hist[s] += (uint64_t) counts[0][s] + counts[1][s] + counts[2][s] + counts[3][s];
+    }
+    return;
+}
+
+// Adds the number of occurrences of each byte value in the n bytes of buf to
+// hist
+void histogram_add(uint64_t hist[static ALPHABET], const uint8_t *buf, uint64_t n) {
+    // Count in chunks small enough that no 32-bit counter can overflow
+    for (uint64_t i = 0; i < n; i += HIST_CHUNK) {
+        histogram_kernel(hist, buf + i, n - i < HIST_CHUNK ? n - i : HIST_CHUNK);
+    }
+    return;
+}
+
+//
+// A range of a file to be counted on a worker thread into its own histogram.
+//
+typedef struct HistRange {
+    int fd;
+    uint64_t offset;
+    uint64_t size;
+    bool ok;
+    uint64_t hist[ALPHABET];
+} HistRange;
+
+// Worker thread task: maps the range and counts it in place, or reads it in
+// pieces if it can't be mapped
+static void histogram_range_task(void *arg) {
+    HistRange *r = (HistRange *) arg;
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = r->offset - r->offset % page;
+    uint64_t len = r->size + (r->offset - start);
+    uint8_t *map = (uint8_t *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, r->fd, start);
+    if (map != MAP_FAILED) {
+        madvise(map, len, MADV_SEQUENTIAL);
+        histogram_add(r->hist, map + (r->offset - start), r->size);
+        munmap(map, len);
+        r->ok = true;
+        return;
+    }
+
+    uint8_t *buf = (uint8_t *) malloc(HIST_READ);
+    uint64_t done = 0;
+    while (buf && done < r->size) {
+        uint64_t want = r->size - done < HIST_READ ? r->size - done : HIST_READ;
+        ssize_t bytes = pread(r->fd, buf, want, r->offset + done);
+        if (bytes <= 0) {
+            break;
+        }
+        histogram_add(r->hist, buf, bytes);
+        done += bytes;
+    }
+    r->ok = done == r->size;
+    free(buf);
+    return;
+}
+
+//
+// Adds the byte counts of size bytes of the regular file fd, starting at
+// offset, to hist. The range is split across the threads of the pool, each
+// counting into private counters which are merged at the end. The file
+// position is left untouched. Returns false, leaving hist as it was, if the
+// file can't be read.
+//
+bool histogram_file(uint64_t hist[static ALPHABET], int fd, uint64_t offset, uint64_t size, Pool *pool) {
+    uint32_t n = pool_threads(pool);
+    uint64_t part = (size + n - 1) / n;
+    part = (part + HIST_ALIGN - 1) / HIST_ALIGN * HIST_ALIGN;
+    HistRange *ranges = (HistRange *) calloc(n, sizeof(HistRange));
+    if (!ranges) {
+        return false;
+    }
+
+    uint32_t k = 0;
+    for (uint64_t pos = 0; pos < size; pos += part) {
+        ranges[k].fd = fd;
+        ranges[k].offset = offset + pos;
+        ranges[k].size = size - pos < part ? size - pos : part;
+        pool_submit(pool, histogram_range_task, &ranges[k]);
+        k += 1;
+    }
+    pool_wait(pool);
+
+    bool ok = true;
+    for (uint32_t i = 0; i < k; i++) {
+        ok = ok && ranges[i].ok;
+    }
+    for (uint32_t i = 0; ok && i < k; i++) {
+        for (int s = 0; s < ALPHABET; s++) {
+            hist[s] += ranges[i].hist[s];
+        }
+    }
+    free(ranges);
+    return ok;
+}
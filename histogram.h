@@ -0,0 +1,14 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include "defines.h"
+#include "pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void histogram_add(uint64_t hist[static ALPHABET], const uint8_t *buf, uint64_t n);
+
+bool histogram_file(uint64_t hist[static ALPHABET], int fd, uint64_t offset, uint64_t size, Pool *pool);
+
+#endif
@@ -5,6 +5,56 @@
 
 #include <stdlib.h>
 
+//
+// Item of a package-merge list: either a leaf for symbol, or (symbol is -1)
+// a package of two items of the list one level deeper.
+//
+typedef struct Item {
+    uint64_t weight;
+    int16_t symbol;
+} Item;
+
+// Orders leaves by increasing weight, then by symbol
+static int item_cmp(const void *a, const void *b) {
+    const Item *x = (const Item *) a;
+    const Item *y = (const Item *) b;
+    if (x->weight != y->weight) {
+        return x->weight < y->weight ? -1 : 1;
+    }
+    return x->symbol - y->symbol;
+}
+
+// Restores the max-heap order of items below index i of a heap of n items
+static void item_sift(Item *items, uint32_t i, uint32_t n) {
+    Item top = items[i];
+    for (uint32_t child = 2 * i + 1; child < n; child = 2 * i + 1) {
+        if (child + 1 < n && item_cmp(&items[child + 1], &items[child]) > 0) {
+            child += 1;
+        }
+        if (item_cmp(&items[child], &top) <= 0) {
+            break;
+        }
+        items[i] = items[child];
+        i = child;
+    }
+    items[i] = top;
+    return;
+}
+
+// Sorts items in place with heapsort, in the order of item_cmp()
+static void item_sort(Item *items, uint32_t n) {
+    for (uint32_t i = n / 2; i-- > 0;) {
+        item_sift(items, i, n);
+    }
+    for (uint32_t end = n; end-- > 1;) {
+        Item t = items[0];
+        items[0] = items[end];
+        items[end] = t;
+        item_sift(items, 0, end);
+    }
+    return;
+}
+
 // Constructs a Huffman tree given a computed histogram. Returns the root of the tree.
 Node *build_tree(uint64_t hist[static ALPHABET]) {
     PriorityQueue *pq = pq_create(ALPHABET);
@@ -37,31 +87,38 @@ Node *build_tree(uint64_t hist[static ALPHABET]) {
     return root;
 }
 
-// Populates the code table. Constructed codes are copied to table.
-void build_codes(Node *root, Code table[static ALPHABET]) {
-    static Code curr_code; // Static structs are zero initialized by default
+// Copies the code of every leaf of the subtree at root to table. curr_code
+// holds the path taken from the root of the tree.
+static void build_codes_rec(Node *root, Code table[static ALPHABET], Code *curr_code) {
     // If both children are NULL, then we are at a leaf node
     if (root->left == NULL && root->right == NULL) {
-        table[root->symbol] = curr_code; // Add current code to code table
+        table[root->symbol] = *curr_code; // Add current code to code table
         return;
     } else {
         // Current node is an interior node
         uint8_t popped_bit; // Throwaway variable for storing popped bits
 
         // Push 0 and recurse left
-        code_push_bit(&curr_code, 0);
-        build_codes(root->left, table);
-        code_pop_bit(&curr_code, &popped_bit); // Pop from code after returning
+        code_push_bit(curr_code, 0);
+        build_codes_rec(root->left, table, curr_code);
+        code_pop_bit(curr_code, &popped_bit); // Pop from code after returning
 
         // Push 1 and recurse right
-        code_push_bit(&curr_code, 1);
-        build_codes(root->right, table);
-        code_pop_bit(&curr_code, &popped_bit);
+        code_push_bit(curr_code, 1);
+        build_codes_rec(root->right, table, curr_code);
+        code_pop_bit(curr_code, &popped_bit);
 
         return;
     }
 }
 
+// Populates the code table. Constructed codes are copied to table.
+void build_codes(Node *root, Code table[static ALPHABET]) {
+    Code curr_code = code_init();
+    build_codes_rec(root, table, &curr_code);
+    return;
+}
+
 // Returns the root node to the tree constructed from the treedump array.
 // Iterates over contents of tree dump array and reconstructs the tree
 // using a stack of nodes.
@@ -109,3 +166,332 @@ void delete_tree(Node **root) {
         }
     }
 }
+
+//
+// Rebuilds the tree from a tree dump into one FlatTree, with a stack of child
+// values standing in for the stack of nodes. Returns NULL if the dump is
+// malformed or memory can't be allocated.
+//
+FlatTree *rebuild_flat_tree(uint16_t nbytes, uint8_t tree[static nbytes]) {
+    uint16_t stack[ALPHABET];
+    uint32_t top = 0;
+    FlatTree *t = (FlatTree *) malloc(sizeof(FlatTree));
+    if (!t) {
+        return NULL;
+    }
+    t->size = 0;
+    for (uint32_t i = 0; i < nbytes; i++) {
+        if (tree[i] == 'L' && i + 1 < nbytes && top < ALPHABET) {
+            stack[top++] = FLAT_LEAF | tree[i + 1];
+            i += 1;
+        } else if (tree[i] == 'I' && top >= 2 && t->size < ALPHABET - 1) {
+            // Children are popped right first, the joined node takes their place
+            t->nodes[t->size][1] = stack[--top];
+            t->nodes[t->size][0] = stack[--top];
+            stack[top++] = t->size;
+            t->size += 1;
+        } else {
+            free(t);
+            return NULL;
+        }
+    }
+    if (top != 1) {
+        free(t);
+        return NULL;
+    }
+    t->root = stack[0];
+    return t;
+}
+
+// Destructor for a flattened tree
+void delete_flat_tree(FlatTree **t) {
+    if (*t) {
+        free(*t);
+        *t = NULL;
+    }
+    return;
+}
+
+// Records the depth of each leaf of the tree, which is the length of the
+// code for its symbol. Symbols not in the tree get a length of 0.
+static void build_lengths_rec(Node *root, uint8_t lengths[static ALPHABET], uint8_t depth) {
+    if (root->left == NULL && root->right == NULL) {
+        lengths[root->symbol] = depth;
+        return;
+    } else {
+        build_lengths_rec(root->left, lengths, depth + 1);
+        build_lengths_rec(root->right, lengths, depth + 1);
+        return;
+    }
+}
+
+// Populates the code length table from a Huffman tree
+void build_lengths(Node *root, uint8_t lengths[static ALPHABET]) {
+    for (int i = 0; i < ALPHABET; i++) {
+        lengths[i] = 0;
+    }
+    build_lengths_rec(root, lengths, 0);
+    return;
+}
+
+//
+// Computes optimal (Huffman) code lengths straight from a histogram, without
+// building a tree or allocating memory. Symbols not in the histogram get a
+// length of 0, as does the only symbol of a histogram with one symbol.
+//
+// Uses the in-place method of Moffat and Katajainen on the weights sorted in
+// increasing order: the first pass joins the two lightest of the remaining
+// leaves and internal nodes left to right, overwriting each consumed internal
+// weight with the index of its parent. The second pass turns parent indices
+// into internal node depths, and the third hands out leaf depths level by
+// level from the number of internal nodes at each depth.
+//
+void optimal_lengths(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET]) {
+    Item leaves[ALPHABET];
+    uint64_t a[ALPHABET];
+    uint32_t n = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        lengths[i] = 0;
+        if (hist[i]) {
+            leaves[n].weight = hist[i];
+            leaves[n].symbol = (int16_t) i;
+            n += 1;
+        }
+    }
+    if (n < 2) {
+        return;
+    }
+    item_sort(leaves, n);
+    for (uint32_t i = 0; i < n; i++) {
+        a[i] = leaves[i].weight;
+    }
+
+    // Join pairs, a[root] is the next unconsumed internal node, a[leaf] the next leaf
+    uint32_t root = 0, leaf = 2;
+    a[0] += a[1];
+    for (uint32_t next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+
+    // Parent indices to depths, the root at n - 2 has depth 0
+    a[n - 2] = 0;
+    for (uint32_t next = n - 2; next-- > 0;) {
+        a[next] = a[a[next]] + 1;
+    }
+
+    // Each level has twice as many slots as internal nodes one level up,
+    // slots not taken by internal nodes are leaves, heaviest first
+    uint32_t avail = 1, used = 0, depth = 0;
+    int64_t node = n - 2, next = n - 1;
+    while (avail > 0) {
+        while (node >= 0 && a[node] == depth) {
+            used += 1;
+            node -= 1;
+        }
+        while (avail > used) {
+            lengths[leaves[next].symbol] = (uint8_t) depth;
+            next -= 1;
+            avail -= 1;
+        }
+        avail = 2 * used;
+        depth += 1;
+        used = 0;
+    }
+    return;
+}
+
+//
+// Populates the code table with canonical codes for the given code lengths.
+// Symbols are assigned consecutive codes in order of length and then symbol
+// value, so the lengths alone are enough to reconstruct every code.
+//
+void canonical_codes(uint8_t lengths[static ALPHABET], Code table[static ALPHABET]) {
+    Code c = code_init();
+    bool first = true;
+    for (int len = 1; len < ALPHABET; len++) {
+        for (int i = 0; i < ALPHABET; i++) {
+            if (lengths[i] != len) {
+                continue;
+            }
+            if (!first) {
+                // Increment the code: clear trailing ones and set the first zero
+                uint8_t bit;
+                while (code_pop_bit(&c, &bit) && bit) { }
+                code_push_bit(&c, 1);
+            }
+            // Pad with zeros out to the code length
+            while (code_size(&c) < (uint32_t) len) {
+                code_push_bit(&c, 0);
+            }
+            table[i] = c;
+            first = false;
+        }
+    }
+    return;
+}
+
+//
+// Writes the code lengths to buf in compact form and returns the number of
+// bytes written (at most MAX_LENS_SIZE):
+//   1 byte: the longest code length L
+//   L bytes: the number of symbols with codes of length 1..L (the count for
+//            length L is stored minus one, so that 256 fits in a byte)
+//   1 byte per symbol: the symbols in order of code length, then value
+//
+uint16_t lengths_dump(uint8_t lengths[static ALPHABET], uint8_t *buf) {
+    uint16_t counts[ALPHABET] = { 0 };
+    uint8_t max_length = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        counts[lengths[i]] += 1;
+        max_length = lengths[i] > max_length ? lengths[i] : max_length;
+    }
+
+    uint16_t n = 0;
+    buf[n++] = max_length;
+    for (int len = 1; len <= max_length; len++) {
+        buf[n++] = (uint8_t) (len == max_length ? counts[len] - 1 : counts[len]);
+    }
+    for (int len = 1; len <= max_length; len++) {
+        for (int i = 0; i < ALPHABET; i++) {
+            if (lengths[i] == len) {
+                buf[n++] = (uint8_t) i;
+            }
+        }
+    }
+    return n;
+}
+
+// Reads code lengths written by lengths_dump(). Returns false if the dump is
+// malformed.
+bool lengths_load(uint16_t nbytes, uint8_t buf[static nbytes], uint8_t lengths[static ALPHABET]) {
+    for (int i = 0; i < ALPHABET; i++) {
+        lengths[i] = 0;
+    }
+    if (nbytes < 1 || buf[0] == 0 || nbytes < 1 + buf[0]) {
+        return false;
+    }
+
+    uint8_t max_length = buf[0];
+    uint16_t n = 1 + max_length;
+    for (int len = 1; len <= max_length; len++) {
+        uint16_t count = buf[len] + (len == max_length ? 1 : 0);
+        if (n + count > nbytes) {
+            return false;
+        }
+        for (uint16_t j = 0; j < count; j++) {
+            if (lengths[buf[n]]) {
+                return false; // Symbol listed twice
+            }
+            lengths[buf[n]] = (uint8_t) len;
+            n += 1;
+        }
+    }
+    return n == nbytes;
+}
+
+// Returns the total number of bits needed to code a histogram with the given code lengths
+uint64_t coded_bits(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        bits += hist[i] * lengths[i];
+    }
+    return bits;
+}
+
+//
+// Replaces lengths with optimal code lengths of at most limit bits, computed
+// with the package-merge algorithm. Does nothing if no code is longer than
+// limit already. Returns false if limit is too small for the number of
+// symbols or memory can't be allocated.
+//
+// The list for the deepest level holds the leaves sorted by weight. Each
+// shallower list merges the leaves with packages of adjacent pairs of the
+// list below. The first 2n - 2 items of the shallowest list are the optimal
+// choice; a symbol's code length is the number of levels where its leaf is
+// among the chosen items.
+//
+bool limit_lengths(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET], uint8_t limit) {
+    Item leaves[ALPHABET];
+    uint32_t n = 0;
+    uint8_t max_length = 0;
+    for (int i = 0; i < ALPHABET; i++) {
+        if (hist[i]) {
+            leaves[n].weight = hist[i];
+            leaves[n].symbol = (int16_t) i;
+            n += 1;
+        }
+        max_length = lengths[i] > max_length ? lengths[i] : max_length;
+    }
+    if (max_length <= limit) {
+        return true;
+    }
+    if (limit == 0 || limit > PACKED_BITS || (UINT64_C(1) << limit) < n) {
+        return false;
+    }
+    item_sort(leaves, n);
+
+    // lists[j] is the list for code length limit - j, each has at most 2n - 1 items
+    Item *lists = (Item *) malloc((size_t) limit * (2 * n - 1) * sizeof(Item));
+    uint32_t *sizes = (uint32_t *) calloc(limit, sizeof(uint32_t));
+    if (!lists || !sizes) {
+        free(lists);
+        free(sizes);
+        return false;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        lists[i] = leaves[i];
+    }
+    sizes[0] = n;
+    for (uint32_t j = 1; j < limit; j++) {
+        Item *prev = lists + (j - 1) * (2 * n - 1);
+        Item *curr = lists + j * (2 * n - 1);
+        uint32_t packages = sizes[j - 1] / 2;
+        uint32_t l = 0, p = 0, k = 0;
+        // Merge leaves with packages, leaves first on ties
+        while (l < n || p < packages) {
+            uint64_t pw = p < packages ? prev[2 * p].weight + prev[2 * p + 1].weight : 0;
+            if (p == packages || (l < n && leaves[l].weight <= pw)) {
+                curr[k++] = leaves[l++];
+            } else {
+                curr[k].weight = pw;
+                curr[k].symbol = -1;
+                k += 1;
+                p += 1;
+            }
+        }
+        sizes[j] = k;
+    }
+
+    // Walk back down, expanding the chosen packages at each level
+    for (int i = 0; i < ALPHABET; i++) {
+        lengths[i] = 0;
+    }
+    uint32_t take = 2 * n - 2;
+    for (int32_t j = limit - 1; j >= 0; j--) {
+        Item *curr = lists + j * (2 * n - 1);
+        uint32_t packages = 0;
+        for (uint32_t i = 0; i < take; i++) {
+            if (curr[i].symbol < 0) {
+                packages += 1;
+            } else {
+                lengths[curr[i].symbol] += 1;
+            }
+        }
+        take = 2 * packages;
+    }
+
+    free(lists);
+    free(sizes);
+    return true;
+}
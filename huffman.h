@@ -5,8 +5,23 @@
 #include "defines.h"
 #include "node.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
+//
+// Huffman tree flattened into a single allocation. nodes[i] holds the left
+// and right children of internal node i. A child with FLAT_LEAF set is a leaf
+// with its symbol in the low byte, otherwise it is the index of another
+// internal node. root is a child value, so a tree of one leaf has no nodes.
+//
+#define FLAT_LEAF 0x8000
+
+typedef struct FlatTree {
+    uint16_t root;
+    uint16_t size;
+    uint16_t nodes[ALPHABET - 1][2];
+} FlatTree;
+
 Node *build_tree(uint64_t hist[static ALPHABET]);
 
 void build_codes(Node *root, Code table[static ALPHABET]);
@@ -15,4 +30,22 @@ Node *rebuild_tree(uint16_t nbytes, uint8_t tree[static nbytes]);
 
 void delete_tree(Node **root);
 
+FlatTree *rebuild_flat_tree(uint16_t nbytes, uint8_t tree[static nbytes]);
+
+void delete_flat_tree(FlatTree **t);
+
+void build_lengths(Node *root, uint8_t lengths[static ALPHABET]);
+
+void optimal_lengths(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET]);
+
+bool limit_lengths(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET], uint8_t limit);
+
+uint64_t coded_bits(uint64_t hist[static ALPHABET], uint8_t lengths[static ALPHABET]);
+
+void canonical_codes(uint8_t lengths[static ALPHABET], Code table[static ALPHABET]);
+
+uint16_t lengths_dump(uint8_t lengths[static ALPHABET], uint8_t *buf);
+
+bool lengths_load(uint16_t nbytes, uint8_t buf[static nbytes], uint8_t lengths[static ALPHABET]);
+
 #endif
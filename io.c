@@ -5,30 +5,16 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
-
-static uint8_t buffer[BLOCK] = { 0 };
-static uint32_t index = 0; // Index of bit in the buffer
-
-// Sets the ith bit of the buffer
-void buffer_set_bit(uint32_t i) {
-    buffer[i / 8] |= 0x1 << (i % 8);
-}
-
-// Clears the ith bit of the buffer
-void buffer_clr_bit(uint32_t i) {
-    buffer[i / 8] &= ~(0x1 << (i % 8));
-}
-
-// Gets the ith bit of the buffer
-uint8_t buffer_get_bit(uint32_t i) {
-    return 1 & (buffer[i / 8] >> (i % 8));
-}
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 //
 // Reads in nbytes from infile, and stores them in buf.
 // Looped calls to read() gurantees we read at most nbytes (unless we read EOF).
-// Returns the number of bytes read.
+// Returns the number of bytes read, or -1 on error.
 //
 int read_bytes(int infile, uint8_t *buf, int nbytes) {
     int current_bytes_read = 0;
@@ -37,12 +23,13 @@ int read_bytes(int infile, uint8_t *buf, int nbytes) {
     // Loop calls to read() until we've read in nbytes
     while (true) {
         // Read in bytes
-        if ((bytes = read(infile, buf + current_bytes_read, nbytes)) <= 0) {
-            break;
+        if ((bytes = read(infile, buf + current_bytes_read, nbytes - current_bytes_read)) < 0) {
+            return -1;
+        } else if (bytes == 0) {
+            break; // EOF
         }
 
         current_bytes_read += bytes; // Bytes read in this call
-        bytes_read += bytes; // Bytes read total
 
         if (current_bytes_read == nbytes) {
             break;
@@ -62,12 +49,11 @@ int write_bytes(int outfile, uint8_t *buf, int nbytes) {
     // Loop calls to write() until we've written all bytes in buf to outfile
     while (true) {
         // Write bytes out from buffer
-        if ((bytes = write(outfile, buf + current_bytes_written, nbytes)) <= 0) {
+        if ((bytes = write(outfile, buf + current_bytes_written, nbytes - current_bytes_written)) <= 0) {
             break;
         }
 
         current_bytes_written += bytes; // Bytes written in this call
-        bytes_written += bytes; // Bytes written total
 
         if (current_bytes_written == nbytes) {
             break;
@@ -77,61 +63,179 @@ int write_bytes(int outfile, uint8_t *buf, int nbytes) {
     return current_bytes_written;
 }
 
-// Fill bits of infile into  buffer, then return each bit of that buffer. When
-// buffer is empty, refill it. Once no more bits can be read from infile, return
-// false. Return true if more bits can be read in.
-bool read_bit(int infile, uint8_t *bit) {
-    if (index == 0) {
-        if (read_bytes(infile, buffer, BLOCK) == 0) {
-            return false;
+//
+// Reads in nbytes from infile starting at offset, and stores them in buf.
+// The file position is left untouched, so several threads can read from the
+// same file at once.
+// Returns the number of bytes read, or -1 on error.
+//
+int64_t pread_bytes(int infile, uint8_t *buf, uint64_t nbytes, uint64_t offset) {
+    uint64_t total = 0;
+    while (total < nbytes) {
+        ssize_t bytes = pread(infile, buf + total, nbytes - total, offset + total);
+        if (bytes < 0) {
+            return -1;
+        } else if (bytes == 0) {
+            break; // EOF
         }
+        total += bytes;
     }
+    return total;
+}
 
-    *bit = buffer_get_bit(index);
-    index += 1;
+//
+// Writes out nbytes from buf to outfile starting at offset. Like
+// pread_bytes(), safe to call from several threads at once.
+// Returns the number of bytes written, or -1 on error.
+//
+int64_t pwrite_bytes(int outfile, uint8_t *buf, uint64_t nbytes, uint64_t offset) {
+    uint64_t total = 0;
+    while (total < nbytes) {
+        ssize_t bytes = pwrite(outfile, buf + total, nbytes - total, offset + total);
+        if (bytes <= 0) {
+            return -1;
+        }
+        total += bytes;
+    }
+    return total;
+}
 
-    if (index == (BLOCK * 8)) {
-        index = 0;
+//
+// Copies nbytes from infile at in_offset to outfile at out_offset. The copy
+// is done in the kernel with copy_file_range() where the files allow it, and
+// otherwise through a buffer. Like pread_bytes(), safe to call from several
+// threads at once. Returns the number of bytes copied, or -1 on error.
+//
+int64_t pcopy_bytes(int infile, uint64_t in_offset, int outfile, uint64_t out_offset, uint64_t nbytes) {
+    uint64_t total = 0;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    while (total < nbytes) {
+        int64_t in = in_offset + total;
+        int64_t out = out_offset + total;
+        long bytes = syscall(SYS_copy_file_range, infile, &in, outfile, &out, nbytes - total, 0);
+        if (bytes <= 0) {
+            break; // Unsupported for these files, finish with a buffer
+        }
+        total += bytes;
+    }
+#endif
+    if (total == nbytes) {
+        return total;
+    }
+    uint8_t *buf = (uint8_t *) malloc(READ_BUFFER);
+    if (!buf) {
+        return -1;
+    }
+    while (total < nbytes) {
+        uint64_t chunk = nbytes - total < READ_BUFFER ? nbytes - total : READ_BUFFER;
+        int64_t bytes = pread_bytes(infile, buf, chunk, in_offset + total);
+        if (bytes <= 0 || pwrite_bytes(outfile, buf, bytes, out_offset + total) != bytes) {
+            break;
+        }
+        total += bytes;
     }
+    free(buf);
+    return total;
+}
 
-    return true;
+//
+// Initializes a bit reader over the len bytes of buf. If input is not NULL,
+// the reader moves on to the next chunk of input whenever buf runs dry (buf
+// can be NULL and len 0 for a reader which starts by reading from input).
+//
+void bit_reader_init(BitReader *r, Input *input, uint8_t *buf, uint32_t len) {
+    r->input = input;
+    r->buf = buf;
+    r->pos = 0;
+    r->end = len;
+    r->bits = 0;
+    r->count = 0;
+    return;
 }
 
-// Accumulates bits of code in a buffer. When buffer is full, writes
-// code bits to outfile.
-void write_code(int outfile, Code *c) {
-    // Loop over each bit of the code and write to buffer
-    uint32_t i = 0;
-    while (i < code_size(c)) {
-        uint8_t bit = 1 & (c->bits[i / 8] >> (i % 8)); // Get bit of code
-
-        // Either set or clear bit in buffer
-        if (bit) {
-            buffer_set_bit(index);
-        } else {
-            buffer_clr_bit(index);
+// Refills the bit buffer a byte at a time. Used near the end of buf, where
+// a full 8-byte load would run past the valid bytes.
+void bit_reader_refill_slow(BitReader *r) {
+    while (r->count <= 56) {
+        if (r->pos == r->end) {
+            r->pos = 0;
+            r->end = r->input == NULL ? 0 : input_next(r->input, &r->buf);
+            if (r->end == 0) {
+                // Out of input, so pad with zeros
+                r->input = NULL;
+                r->count = 64;
+                return;
+            }
+            if (r->end >= 8) {
+                bit_reader_refill(r);
+                return;
+            }
         }
+        r->bits |= (uint64_t) r->buf[r->pos] << r->count;
+        r->pos += 1;
+        r->count += 8;
+    }
+    return;
+}
 
-        // Increment counters
-        i += 1;
-        index += 1;
+// Initializes a bit writer which stores into buf
+void bit_writer_init(BitWriter *w, uint8_t *buf, uint32_t size) {
+    w->buf = buf;
+    w->pos = 0;
+    w->size = size;
+    w->acc = 0;
+    w->count = 0;
+    return;
+}
 
-        // If buffer is full, write buffer out, and reset index
-        if (index >= BLOCK * 8) {
-            write_bytes(outfile, buffer, BLOCK);
-            index = 0;
+// Writes a code which is too long to be packed, 32 bits at a time
+void bit_writer_put_code(BitWriter *w, Code *c) {
+    for (uint32_t i = 0; i < code_size(c); i += 32) {
+        uint32_t nbits = code_size(c) - i < 32 ? code_size(c) - i : 32;
+        uint64_t bits = 0;
+        for (uint32_t j = 0; j < 4; j++) {
+            bits |= (uint64_t) c->bits[i / 8 + j] << (8 * j);
         }
+        bit_writer_put(w, bits & ((UINT64_C(1) << nbits) - 1), nbits);
     }
+    return;
+}
 
+//
+// Writes the codes for n symbols of buf. buf must have room for n codes of the
+// longest length in the table. Codes longer than PACKED_BITS are rare enough
+// to take a slow path.
+//
+void write_symbols(
+    BitWriter *w, PackedCode packed[static ALPHABET], Code table[static ALPHABET], uint8_t *buf, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        PackedCode p = packed[buf[i]];
+        if (packed_length(p) <= PACKED_BITS) {
+            bit_writer_put(w, packed_bits(p), packed_length(p));
+        } else {
+            bit_writer_put_code(w, &table[buf[i]]);
+        }
+    }
     return;
 }
 
-// Writes remaining code bits left in buffer out to the outfile
-void flush_codes(int outfile) {
-    // If index is divisible by 8, we write index / 8 bytes of buffer out.
-    // If not, then we write (index / 8) + 1 bytes out.
-    uint32_t byte_num = (index - 1) % 8 == 0 ? (index - 1) / 8 : ((index - 1) / 8) + 1;
-    write_bytes(outfile, buffer, byte_num);
-    index = 0; // Reset index to beginning
+// Stores the remaining pending bits, padding the last byte with zeros.
+// Returns the number of bytes in the writer's buffer.
+uint32_t bit_writer_finish(BitWriter *w) {
+    while (w->count > 0) {
+        w->buf[w->pos] = (uint8_t) w->acc;
+        w->pos += 1;
+        w->acc >>= 8;
+        w->count = w->count > 8 ? w->count - 8 : 0;
+    }
+    w->acc = 0;
+    return w->pos;
+}
+
+// Writes out the whole bytes stored in the writer's buffer and empties it.
+// Pending bits in the accumulator are kept.
+void bit_writer_drain(BitWriter *w, Output *out) {
+    output_write(out, w->buf, w->pos);
+    w->pos = 0;
     return;
 }
@@ -1,22 +1,129 @@
 #ifndef __IO_H__
 #define __IO_H__
 
+#include "backend.h"
 #include "code.h"
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
-extern uint64_t bytes_read;
-extern uint64_t bytes_written;
+//
+// Bit reader which keeps up to 64 bits of input in a register-sized buffer so
+// that several bits can be peeked and consumed at once. Bits are consumed in
+// the same order BitWriter produces them: least significant bit first.
+//
+// input: Input to refill from, or NULL once it is exhausted / for memory input
+// buf: Chunk of input not yet moved into bits
+// pos: Index of the next unread byte in buf
+// end: Number of valid bytes in buf
+// bits: Pending input bits, next bit in the least significant position
+// count: Number of valid bits in bits
+//
+typedef struct BitReader {
+    Input *input;
+    uint8_t *buf;
+    uint32_t pos;
+    uint32_t end;
+    uint64_t bits;
+    uint32_t count;
+} BitReader;
+
+//
+// Bit writer which accumulates codes in a 64-bit register and stores whole
+// words into buf. Bits are written least significant bit first.
+//
+// buf: Output buffer, must have 8 bytes of room whenever bits are put
+// pos: Number of bytes stored in buf
+// size: Capacity of buf
+// acc: Pending bits not yet stored in buf
+// count: Number of pending bits in acc
+//
+typedef struct BitWriter {
+    uint8_t *buf;
+    uint32_t pos;
+    uint32_t size;
+    uint64_t acc;
+    uint32_t count;
+} BitWriter;
 
 int read_bytes(int infile, uint8_t *buf, int nbytes);
 
 int write_bytes(int outfile, uint8_t *buf, int nbytes);
 
-bool read_bit(int infile, uint8_t *bit);
+int64_t pread_bytes(int infile, uint8_t *buf, uint64_t nbytes, uint64_t offset);
+
+int64_t pwrite_bytes(int outfile, uint8_t *buf, uint64_t nbytes, uint64_t offset);
+
+int64_t pcopy_bytes(int infile, uint64_t in_offset, int outfile, uint64_t out_offset, uint64_t nbytes);
+
+void bit_reader_init(BitReader *r, Input *input, uint8_t *buf, uint32_t len);
+
+void bit_reader_refill_slow(BitReader *r);
+
+// Loads 8 bytes as a little endian 64-bit word
+static inline uint64_t load_le64(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+void bit_writer_init(BitWriter *w, uint8_t *buf, uint32_t size);
+
+void bit_writer_put_code(BitWriter *w, Code *c);
+
+void write_symbols(
+    BitWriter *w, PackedCode packed[static ALPHABET], Code table[static ALPHABET], uint8_t *buf, uint32_t n);
+
+uint32_t bit_writer_finish(BitWriter *w);
+
+void bit_writer_drain(BitWriter *w, Output *out);
+
+// Stores a 64-bit word as 8 little endian bytes
+static inline void store_le64(uint8_t *p, uint64_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(p, &word, sizeof(word));
+}
+
+// Appends the low nbits bits of bits (at most 64, higher bits must be clear)
+static inline void bit_writer_put(BitWriter *w, uint64_t bits, uint32_t nbits) {
+    w->acc |= bits << w->count;
+    w->count += nbits;
+    if (w->count >= 64) {
+        store_le64(w->buf + w->pos, w->acc);
+        w->pos += 8;
+        w->count -= 64;
+        // Carry over the bits which didn't fit in the stored word
+        w->acc = w->count ? bits >> (nbits - w->count) : 0;
+    }
+}
+
+// Tops the bit buffer up to at least 56 bits. Past the end of input the
+// buffer is padded with zero bits.
+static inline void bit_reader_refill(BitReader *r) {
+    if (r->end - r->pos >= 8) {
+        r->bits |= load_le64(r->buf + r->pos) << r->count;
+        r->pos += (63 - r->count) >> 3;
+        r->count |= 56;
+    } else {
+        bit_reader_refill_slow(r);
+    }
+}
 
-void write_code(int outfile, Code *c);
+// Returns the next nbits bits without consuming them
+static inline uint64_t bit_reader_peek(BitReader *r, uint32_t nbits) {
+    return r->bits & ((UINT64_C(1) << nbits) - 1);
+}
 
-void flush_codes(int outfile);
+// Consumes nbits bits from the bit buffer
+static inline void bit_reader_consume(BitReader *r, uint32_t nbits) {
+    r->bits >>= nbits;
+    r->count -= nbits;
+}
 
 #endif
@@ -0,0 +1,826 @@
+#include "libhuffman.h"
+
+#include "block.h"
+#include "code.h"
+#include "defines.h"
+#include "header.h"
+#include "huffman.h"
+#include "io.h"
+#include "table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Most bytes the coded data of a block takes over a byte per symbol and its
+// code lengths: the padded bits of the two extra symbols block_encode()
+// counts, the bitstream sizes and the padding of each bitstream
+#define BLOCK_SLACK (3 + 4 * (STREAMS - 1) + STREAMS)
+
+//
+// Growable byte buffer of data waiting to be consumed.
+//
+// buf: Buffered data
+// pos: Bytes of buf already consumed
+// len: Bytes in buf
+// size: Capacity of buf
+//
+typedef struct Pending {
+    uint8_t *buf;
+    uint64_t pos;
+    uint64_t len;
+    uint64_t size;
+} Pending;
+
+//
+// Definition of struct HuffEncoder, which splits the input pushed to it into
+// blocks and hands out the compressed file a piece at a time.
+//
+// block_size, limit: Input bytes per block, and code length limit (0 for none)
+// src, fill: Input of the block being filled, and the bytes in it
+// out: Compressed data not yet pulled
+// index, blocks, slots: Index entries of the blocks so far, their number and room
+// comp_offset, raw_offset: Offsets of the next block in the output and input
+// started, finishing, done: Header written, no more input, trailer written
+// status: First error hit, every later call returns it
+//
+struct HuffEncoder {
+    uint32_t block_size;
+    uint8_t limit;
+    uint8_t *src;
+    uint32_t fill;
+    Pending out;
+    IndexEntry *index;
+    uint32_t blocks;
+    uint32_t slots;
+    uint64_t comp_offset;
+    uint64_t raw_offset;
+    bool started;
+    bool finishing;
+    bool done;
+    HuffStatus status;
+};
+
+//
+// What a decoder expects next: the file header, a block, or the bits of a
+// single-stream file. Once done, the rest of the input is ignored.
+//
+typedef enum DecodeState { DECODE_HEADER, DECODE_BLOCKS, DECODE_STREAM, DECODE_DONE } DecodeState;
+
+//
+// Definition of struct HuffDecoder, which decompresses the data pushed to it
+// a block at a time. Single-stream files have no block boundaries, so their
+// compressed data is buffered until the end of input and then decoded
+// WRITE_BUFFER bytes at a time.
+//
+// state, header: What comes next, and the file header once read
+// in: Compressed data not yet decoded
+// out: Decompressed data not yet pulled
+// finishing: No more input will be pushed
+// status: First error hit, every later call returns it
+// table, tree, reader, remaining: Decoder state of a single-stream file
+// dict, dict_id, dict_lengths: Whether the decoder was given a dictionary, and
+//                              its ID and code lengths
+//
+struct HuffDecoder {
+    DecodeState state;
+    Header header;
+    Pending in;
+    Pending out;
+    bool finishing;
+    HuffStatus status;
+    DecodeTable *table;
+    FlatTree *tree;
+    BitReader reader;
+    uint64_t remaining;
+    bool dict;
+    uint32_t dict_id;
+    uint8_t dict_lengths[ALPHABET];
+};
+
+static const char *status_names[] = { "ok", "end of data", "out of memory", "corrupt data", "output buffer too small",
+    "invalid arguments" };
+
+// Returns a description of a status
+const char *huff_status_name(HuffStatus status) {
+    return status <= HUFF_ARGS ? status_names[status] : "unknown status";
+}
+
+// Grows p to hold at least n bytes. Returns false if memory can't be allocated.
+static bool pending_reserve(Pending *p, uint64_t n) {
+    if (n <= p->size) {
+        return true;
+    }
+    uint64_t size = p->size ? p->size : 4096;
+    while (size < n) {
+        size *= 2;
+    }
+    uint8_t *grown = (uint8_t *) realloc(p->buf, size);
+    if (!grown) {
+        return false;
+    }
+    p->buf = grown;
+    p->size = size;
+    return true;
+}
+
+// Appends n bytes of src to p. Returns false if memory can't be allocated.
+static bool pending_append(Pending *p, const void *src, uint64_t n) {
+    if (!pending_reserve(p, p->len + n)) {
+        return false;
+    }
+    memcpy(p->buf + p->len, src, n);
+    p->len += n;
+    return true;
+}
+
+// Moves up to cap unconsumed bytes of p into dst, and returns how many were
+// moved. p starts over from the beginning once it is drained.
+static uint64_t pending_take(Pending *p, uint8_t *dst, uint64_t cap) {
+    uint64_t n = p->len - p->pos < cap ? p->len - p->pos : cap;
+    memcpy(dst, p->buf + p->pos, n);
+    p->pos += n;
+    if (p->pos == p->len) {
+        p->pos = 0;
+        p->len = 0;
+    }
+    return n;
+}
+
+// Drops the consumed bytes from the front of p
+static void pending_compact(Pending *p) {
+    memmove(p->buf, p->buf + p->pos, p->len - p->pos);
+    p->len -= p->pos;
+    p->pos = 0;
+    return;
+}
+
+// Returns true if a block size and code length limit can be used
+static bool options_valid(uint32_t block_size, uint8_t limit) {
+    return block_size <= MAX_BLOCK && (limit == 0 || (limit >= 8 && limit <= PACKED_BITS));
+}
+
+//
+// Returns the largest size the compressed data of n bytes can have. Coded
+// data is never larger than a byte per symbol, since an optimal code does at
+// least as well as the fixed 8-bit code, plus the sizes and padding of the
+// bitstreams.
+//
+uint64_t huff_compress_bound(uint64_t n, uint32_t block_size) {
+    block_size = block_size ? block_size : BLOCK_SIZE;
+    uint64_t blocks = (n + block_size - 1) / block_size;
+    uint64_t per_block = sizeof(BlockHeader) + MAX_LENS_SIZE + BLOCK_SLACK + sizeof(IndexEntry);
+    return sizeof(Header) + n + blocks * per_block + sizeof(BlockHeader) + sizeof(Footer);
+}
+
+//
+// Compresses the n bytes of src into dst, which has room for cap bytes, in
+// blocks of block_size bytes (0 for the default) with codes of at most limit
+// bits (0 for no limit). The compressed size is passed back through size.
+// huff_compress_bound() gives a cap which is always large enough.
+//
+HuffStatus huff_compress(
+    const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap, uint64_t *size, uint32_t block_size, uint8_t limit) {
+    *size = 0;
+    if (!options_valid(block_size, limit)) {
+        return HUFF_ARGS;
+    }
+    HuffEncoder *e = huff_encoder_create(block_size, limit);
+    if (!e) {
+        return HUFF_NOMEM;
+    }
+    HuffStatus status = HUFF_OK;
+    uint64_t taken = 0;
+    while (status == HUFF_OK) {
+        uint64_t pushed = huff_encoder_push(e, src + taken, n - taken);
+        taken += pushed;
+        if (taken == n) {
+            huff_encoder_finish(e);
+        }
+        uint64_t pulled;
+        status = huff_encoder_pull(e, dst + *size, cap - *size, &pulled);
+        *size += pulled;
+        if (status == HUFF_OK && *size == cap && pushed == 0) {
+            status = HUFF_SPACE; // More output is pending but there's no room for it
+        }
+    }
+    huff_encoder_delete(&e);
+    return status == HUFF_END ? HUFF_OK : status;
+}
+
+//
+// Passes back the decompressed size of the n bytes of compressed data at src
+// through size, from the file header or, for the block format, the footer.
+//
+HuffStatus huff_decompressed_size(const uint8_t *src, uint64_t n, uint64_t *size) {
+    Header header;
+    if (n < sizeof(Header)) {
+        return HUFF_CORRUPT;
+    }
+    memcpy(&header, src, sizeof(Header));
+    if (header.magic == MAGIC || header.magic == MAGIC_CANON || header.magic == MAGIC_DICT) {
+        *size = header.file_size;
+        return HUFF_OK;
+    }
+    Footer footer;
+    if (header.magic != MAGIC_BLOCK || n < sizeof(Header) + sizeof(BlockHeader) + sizeof(Footer)) {
+        return HUFF_CORRUPT;
+    }
+    memcpy(&footer, src + n - sizeof(Footer), sizeof(Footer));
+    if (footer.magic != MAGIC_BLOCK) {
+        return HUFF_CORRUPT;
+    }
+    *size = footer.file_size;
+    return HUFF_OK;
+}
+
+//
+// Decompresses the n bytes of compressed data at src into dst, which has
+// room for cap bytes. The decompressed size is passed back through size.
+// Files coded with a dictionary need huff_decoder_create_dict() instead, and
+// give HUFF_ARGS here.
+//
+HuffStatus huff_decompress(const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap, uint64_t *size) {
+    *size = 0;
+    HuffDecoder *d = huff_decoder_create();
+    if (!d) {
+        return HUFF_NOMEM;
+    }
+    HuffStatus status = HUFF_OK;
+    uint64_t taken = 0;
+    while (status == HUFF_OK) {
+        uint64_t pushed = huff_decoder_push(d, src + taken, n - taken);
+        taken += pushed;
+        if (taken == n) {
+            huff_decoder_finish(d);
+        }
+        uint64_t pulled;
+        status = huff_decoder_pull(d, dst + *size, cap - *size, &pulled);
+        *size += pulled;
+        if (status == HUFF_OK && *size == cap && pushed == 0) {
+            status = HUFF_SPACE; // More output is pending but there's no room for it
+        }
+    }
+    huff_decoder_delete(&d);
+    return status == HUFF_END ? HUFF_OK : status;
+}
+
+// Returns true if a block header is within the sizes encode writes. Coded
+// data never takes more than a byte per symbol, see huff_compress_bound().
+static bool block_valid(BlockHeader *bh) {
+    return bh->raw_size <= MAX_BLOCK && bh->comp_size <= (uint64_t) bh->raw_size + MAX_LENS_SIZE + BLOCK_SLACK;
+}
+
+// Copies entry i of the block index at index_offset in src
+static IndexEntry index_entry(const uint8_t *src, uint64_t index_offset, uint32_t i) {
+    IndexEntry entry;
+    memcpy(&entry, src + index_offset + (uint64_t) i * sizeof(IndexEntry), sizeof(IndexEntry));
+    return entry;
+}
+
+//
+// Decompresses the len bytes at offset of the original data (clamped to its
+// end) from the n bytes of block format data at src into dst, which has room
+// for cap bytes. Only the blocks covering the range are decoded, found by a
+// binary search of the block index, so slices of large files are cheap. The
+// decompressed size is passed back through size. Empty input has no blocks,
+// so for it any range but the empty one at offset 0 is HUFF_ARGS.
+//
+HuffStatus huff_decompress_range(
+    const uint8_t *src, uint64_t n, uint64_t offset, uint64_t len, uint8_t *dst, uint64_t cap, uint64_t *size) {
+    *size = 0;
+    Header header;
+    Footer footer;
+    if (n < sizeof(Header) + sizeof(Footer)) {
+        return HUFF_CORRUPT;
+    }
+    memcpy(&header, src, sizeof(Header));
+    memcpy(&footer, src + n - sizeof(Footer), sizeof(Footer));
+    if (header.magic == MAGIC || header.magic == MAGIC_CANON || header.magic == MAGIC_DICT) {
+        return HUFF_ARGS;
+    } else if (header.magic != MAGIC_BLOCK || footer.magic != MAGIC_BLOCK
+               || footer.index_offset > n - sizeof(Footer)
+               || n - sizeof(Footer) - footer.index_offset != (uint64_t) footer.blocks * sizeof(IndexEntry)
+               || (footer.blocks == 0 && footer.file_size != 0)) {
+        return HUFF_CORRUPT;
+    } else if (footer.blocks == 0) {
+        // Empty input has no blocks, so only the empty range is in it
+        return offset == 0 && len == 0 ? HUFF_OK : HUFF_ARGS;
+    }
+    if (offset >= footer.file_size || len == 0) {
+        return HUFF_OK;
+    }
+    len = len < footer.file_size - offset ? len : footer.file_size - offset;
+    if (len > cap) {
+        return HUFF_SPACE;
+    }
+
+    // Find the last block starting at or before offset
+    uint32_t lo = 0;
+    uint32_t hi = footer.blocks;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index_entry(src, footer.index_offset, mid).raw_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Decode each block covering the range, checking that they follow on
+    // from each other, straight into dst if the whole block is wanted
+    HuffStatus status = HUFF_OK;
+    uint8_t *out = NULL;
+    uint64_t next = index_entry(src, footer.index_offset, lo).raw_offset;
+    for (uint32_t i = lo; i < footer.blocks && *size < len; i++) {
+        IndexEntry entry = index_entry(src, footer.index_offset, i);
+        BlockHeader bh;
+        if (entry.raw_offset != next || entry.raw_offset > offset + *size
+            || offset + *size - entry.raw_offset >= entry.raw_size || entry.comp_size < sizeof(BlockHeader)
+            || entry.comp_offset > footer.index_offset || entry.comp_size > footer.index_offset - entry.comp_offset) {
+            status = HUFF_CORRUPT;
+            break;
+        }
+        memcpy(&bh, src + entry.comp_offset, sizeof(BlockHeader));
+        if (bh.raw_size != entry.raw_size || bh.comp_size + sizeof(BlockHeader) != entry.comp_size
+            || !block_valid(&bh)) {
+            status = HUFF_CORRUPT;
+            break;
+        }
+        uint64_t start = offset + *size - entry.raw_offset;
+        uint64_t count = entry.raw_size - start < len - *size ? entry.raw_size - start : len - *size;
+        uint8_t *data = (uint8_t *) src + entry.comp_offset + sizeof(BlockHeader);
+        if (start == 0 && count == entry.raw_size) {
+            if (!block_decode(&bh, data, dst + *size)) {
+                status = HUFF_CORRUPT;
+                break;
+            }
+        } else {
+            free(out);
+            out = (uint8_t *) malloc(entry.raw_size);
+            if (!out) {
+                status = HUFF_NOMEM;
+                break;
+            } else if (!block_decode(&bh, data, out)) {
+                status = HUFF_CORRUPT;
+                break;
+            }
+            memcpy(dst + *size, out + start, count);
+        }
+        *size += count;
+        next += entry.raw_size;
+    }
+    free(out);
+    if (status == HUFF_OK && *size < len) {
+        status = HUFF_CORRUPT; // The index ends before the file does
+    }
+    return status;
+}
+
+//
+// Constructor for an encoder with blocks of block_size bytes (0 for the
+// default) and codes of at most limit bits (0 for no limit). Returns NULL if
+// the options are invalid or memory can't be allocated.
+//
+HuffEncoder *huff_encoder_create(uint32_t block_size, uint8_t limit) {
+    if (!options_valid(block_size, limit)) {
+        return NULL;
+    }
+    HuffEncoder *e = (HuffEncoder *) calloc(1, sizeof(HuffEncoder));
+    if (!e) {
+        return NULL;
+    }
+    e->block_size = block_size ? block_size : BLOCK_SIZE;
+    e->limit = limit;
+    e->src = (uint8_t *) malloc(e->block_size);
+    if (!e->src) {
+        free(e);
+        return NULL;
+    }
+    e->comp_offset = sizeof(Header);
+    e->status = HUFF_OK;
+    return e;
+}
+
+// Destructor for an encoder
+void huff_encoder_delete(HuffEncoder **e) {
+    if (*e) {
+        free((*e)->src);
+        free((*e)->out.buf);
+        free((*e)->index);
+        free(*e);
+        *e = NULL;
+    }
+    return;
+}
+
+// Compresses the block being filled onto the pending output and indexes it
+static void encoder_block(HuffEncoder *e) {
+    if (e->blocks == e->slots) {
+        uint32_t slots = e->slots ? 2 * e->slots : 64;
+        IndexEntry *grown = (IndexEntry *) realloc(e->index, slots * sizeof(IndexEntry));
+        if (!grown) {
+            e->status = HUFF_NOMEM;
+            return;
+        }
+        e->index = grown;
+        e->slots = slots;
+    }
+    uint32_t size;
+    uint8_t *block = block_encode(e->src, e->fill, e->limit, true, 0, &size);
+    if (!block || !pending_append(&e->out, block, size)) {
+        free(block);
+        e->status = HUFF_NOMEM;
+        return;
+    }
+    free(block);
+    e->index[e->blocks].comp_offset = e->comp_offset;
+    e->index[e->blocks].raw_offset = e->raw_offset;
+    e->index[e->blocks].comp_size = size;
+    e->index[e->blocks].raw_size = e->fill;
+    e->comp_offset += size;
+    e->raw_offset += e->fill;
+    e->blocks += 1;
+    e->fill = 0;
+    return;
+}
+
+// Queues the end marker, index and footer which close the file
+static void encoder_trailer(HuffEncoder *e) {
+    BlockHeader end = { 0 };
+    Footer footer;
+    footer.index_offset = e->comp_offset + sizeof(BlockHeader);
+    footer.file_size = e->raw_offset;
+    footer.blocks = e->blocks;
+    footer.magic = MAGIC_BLOCK;
+    if (!pending_append(&e->out, &end, sizeof(BlockHeader))
+        || !pending_append(&e->out, e->index, (uint64_t) e->blocks * sizeof(IndexEntry))
+        || !pending_append(&e->out, &footer, sizeof(Footer))) {
+        e->status = HUFF_NOMEM;
+    }
+    e->done = true;
+    return;
+}
+
+// Produces the next piece of output once the pending output is drained.
+// Returns false if there's nothing to produce until more input is pushed.
+static bool encoder_step(HuffEncoder *e) {
+    if (!e->started) {
+        Header header;
+        header.magic = MAGIC_BLOCK;
+        header.permissions = 0644; // Not used by decode, which keeps the input's permissions
+        header.tree_size = 0;
+        header.file_size = 0;
+        if (!pending_append(&e->out, &header, sizeof(Header))) {
+            e->status = HUFF_NOMEM;
+        }
+        e->started = true;
+        return true;
+    }
+    if (e->fill == e->block_size || (e->finishing && e->fill > 0)) {
+        encoder_block(e);
+        return true;
+    }
+    if (e->finishing && !e->done) {
+        encoder_trailer(e);
+        return true;
+    }
+    return false;
+}
+
+//
+// Feeds up to n bytes of src to the encoder, and returns how many were taken.
+// At most a block of compressed data is kept pending, so fewer than n bytes
+// are taken once output must be pulled to make room.
+//
+uint64_t huff_encoder_push(HuffEncoder *e, const uint8_t *src, uint64_t n) {
+    uint64_t taken = 0;
+    while (taken < n && e->status == HUFF_OK && !e->finishing) {
+        if (e->fill == e->block_size) {
+            if (e->out.pos != e->out.len) {
+                break;
+            }
+            encoder_step(e);
+            continue;
+        }
+        uint64_t k = e->block_size - e->fill < n - taken ? e->block_size - e->fill : n - taken;
+        memcpy(e->src + e->fill, src + taken, k);
+        e->fill += k;
+        taken += k;
+    }
+    return taken;
+}
+
+// Marks the end of input. The last block and the trailer follow on pull.
+void huff_encoder_finish(HuffEncoder *e) {
+    e->finishing = true;
+    return;
+}
+
+//
+// Moves up to cap bytes of compressed data into dst, passing the number of
+// bytes back through size. Returns HUFF_END once all output after
+// huff_encoder_finish() has been pulled, HUFF_OK if more may follow.
+//
+HuffStatus huff_encoder_pull(HuffEncoder *e, uint8_t *dst, uint64_t cap, uint64_t *size) {
+    *size = 0;
+    while (e->status == HUFF_OK) {
+        if (e->out.pos == e->out.len) {
+            if (!encoder_step(e)) {
+                break;
+            }
+        } else if (*size < cap) {
+            *size += pending_take(&e->out, dst + *size, cap - *size);
+        } else {
+            break;
+        }
+    }
+    if (e->status != HUFF_OK) {
+        return e->status;
+    }
+    return e->done && e->out.pos == e->out.len ? HUFF_END : HUFF_OK;
+}
+
+// Constructor for a decoder. Returns NULL if memory can't be allocated.
+HuffDecoder *huff_decoder_create(void) {
+    HuffDecoder *d = (HuffDecoder *) calloc(1, sizeof(HuffDecoder));
+    if (d) {
+        d->state = DECODE_HEADER;
+        d->status = HUFF_OK;
+    }
+    return d;
+}
+
+// Returns true if every byte has a code length and the lengths describe a
+// prefix code, so that no two canonical codes collide
+static bool dict_lengths_valid(const uint8_t lengths[static ALPHABET]) {
+    uint32_t counts[ALPHABET] = { 0 };
+    for (int i = 0; i < ALPHABET; i++) {
+        if (!lengths[i]) {
+            return false;
+        }
+        counts[lengths[i]] += 1;
+    }
+
+    // Count the codes left free at each length, which can't go negative.
+    // Past ALPHABET free codes every symbol left fits.
+    uint64_t free_codes = 1;
+    for (int len = 1; len < ALPHABET; len++) {
+        free_codes = 2 * free_codes;
+        if (free_codes < counts[len]) {
+            return false;
+        }
+        free_codes -= counts[len];
+        free_codes = free_codes < ALPHABET ? free_codes : ALPHABET;
+    }
+    return true;
+}
+
+//
+// Constructor for a decoder of files coded with the dictionary of ID id,
+// whose canonical code lengths are lengths (see `train`). Files coded
+// without a dictionary are decoded as by huff_decoder_create(), and files
+// coded with another dictionary give HUFF_ARGS. Returns NULL if the lengths
+// aren't a code for every byte or memory can't be allocated.
+//
+HuffDecoder *huff_decoder_create_dict(const uint8_t lengths[256], uint32_t id) {
+    if (!dict_lengths_valid(lengths)) {
+        return NULL;
+    }
+    HuffDecoder *d = huff_decoder_create();
+    if (d) {
+        d->dict = true;
+        d->dict_id = id;
+        memcpy(d->dict_lengths, lengths, ALPHABET);
+    }
+    return d;
+}
+
+// Destructor for a decoder
+void huff_decoder_delete(HuffDecoder **d) {
+    if (*d) {
+        free((*d)->in.buf);
+        free((*d)->out.buf);
+        free((*d)->table);
+        delete_flat_tree(&(*d)->tree);
+        free(*d);
+        *d = NULL;
+    }
+    return;
+}
+
+// Returns how many more bytes of input the decoder needs before it can take
+// its next step, UINT64_MAX if it takes everything up to the end of input
+static uint64_t decoder_wants(HuffDecoder *d) {
+    uint64_t have = d->in.len - d->in.pos;
+    uint64_t need = 0;
+    switch (d->state) {
+    case DECODE_HEADER: need = sizeof(Header); break;
+    case DECODE_BLOCKS:
+        need = sizeof(BlockHeader);
+        if (have >= need) {
+            BlockHeader bh;
+            memcpy(&bh, d->in.buf + d->in.pos, sizeof(BlockHeader));
+            need += bh.raw_size && block_valid(&bh) ? bh.comp_size : 0;
+        }
+        break;
+    case DECODE_STREAM: return UINT64_MAX;
+    case DECODE_DONE: return 0;
+    }
+    return need > have ? need - have : 0;
+}
+
+// Sets up the decode table of a single-stream file, whose compressed data
+// is all buffered in d->in
+static void decoder_stream_start(HuffDecoder *d) {
+    uint64_t have = d->in.len - d->in.pos;
+    uint8_t *data = d->in.buf + d->in.pos;
+    d->table = (DecodeTable *) malloc(sizeof(DecodeTable));
+    if (!d->table) {
+        d->status = HUFF_NOMEM;
+        return;
+    }
+    if (have < d->header.tree_size || have - d->header.tree_size > UINT32_MAX) {
+        // The bit reader takes at most 4GB at once
+        d->status = have < d->header.tree_size ? HUFF_CORRUPT : HUFF_NOMEM;
+        return;
+    }
+    if (d->header.magic == MAGIC_DICT) {
+        // The dictionary is named by a 4-byte ID in place of a tree dump
+        if (have < 4) {
+            d->status = HUFF_CORRUPT;
+            return;
+        }
+        uint32_t id = data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+        if (id != d->dict_id) {
+            d->status = HUFF_ARGS;
+            return;
+        }
+        table_build_canonical(d->table, d->dict_lengths);
+        d->in.pos += 4;
+        bit_reader_init(&d->reader, NULL, data + 4, (uint32_t) (have - 4));
+        d->remaining = d->header.file_size;
+        return;
+    } else if (d->header.magic == MAGIC_CANON) {
+        uint8_t lengths[ALPHABET];
+        if (!lengths_load(d->header.tree_size, data, lengths)) {
+            d->status = HUFF_CORRUPT;
+            return;
+        }
+        table_build_canonical(d->table, lengths);
+    } else {
+        d->tree = rebuild_flat_tree(d->header.tree_size, data);
+        if (!d->tree) {
+            d->status = HUFF_CORRUPT;
+            return;
+        }
+        table_build(d->table, d->tree);
+    }
+    d->in.pos += d->header.tree_size;
+    bit_reader_init(&d->reader, NULL, data + d->header.tree_size, (uint32_t) (have - d->header.tree_size));
+    d->remaining = d->header.file_size;
+    return;
+}
+
+// Decodes the next piece of output once the pending output is drained.
+// Returns false if there's nothing to decode until more input is pushed.
+static bool decoder_step(HuffDecoder *d) {
+    uint64_t have = d->in.len - d->in.pos;
+    uint8_t *data = d->in.buf + d->in.pos;
+    switch (d->state) {
+    case DECODE_HEADER:
+        if (have < sizeof(Header)) {
+            return false;
+        }
+        memcpy(&d->header, data, sizeof(Header));
+        d->in.pos += sizeof(Header);
+        if (d->header.magic == MAGIC_BLOCK) {
+            d->state = DECODE_BLOCKS;
+        } else if (d->header.magic == MAGIC || d->header.magic == MAGIC_CANON) {
+            d->state = DECODE_STREAM;
+        } else if (d->header.magic == MAGIC_DICT) {
+            // Only a decoder given the dictionary can decode the file
+            d->state = DECODE_STREAM;
+            d->status = d->dict ? HUFF_OK : HUFF_ARGS;
+        } else {
+            d->status = HUFF_CORRUPT;
+        }
+        return true;
+    case DECODE_BLOCKS: {
+        BlockHeader bh;
+        if (have < sizeof(BlockHeader)) {
+            return false;
+        }
+        memcpy(&bh, data, sizeof(BlockHeader));
+        if (bh.raw_size == 0) {
+            d->state = DECODE_DONE; // End of the blocks, the index and footer aren't needed
+            return true;
+        }
+        if (!block_valid(&bh)) {
+            d->status = HUFF_CORRUPT;
+            return true;
+        }
+        if (have < sizeof(BlockHeader) + bh.comp_size) {
+            return false;
+        }
+        if (!pending_reserve(&d->out, bh.raw_size)) {
+            d->status = HUFF_NOMEM;
+            return true;
+        }
+        if (!block_decode(&bh, data + sizeof(BlockHeader), d->out.buf)) {
+            d->status = HUFF_CORRUPT;
+            return true;
+        }
+        d->out.len = bh.raw_size;
+        d->in.pos += sizeof(BlockHeader) + bh.comp_size;
+        pending_compact(&d->in);
+        return true;
+    }
+    case DECODE_STREAM: {
+        if (!d->finishing) {
+            return false;
+        }
+        if (!d->table) {
+            decoder_stream_start(d);
+            return true;
+        }
+        if (d->remaining == 0) {
+            d->state = DECODE_DONE;
+            return true;
+        }
+        uint32_t n = d->remaining < WRITE_BUFFER ? d->remaining : WRITE_BUFFER;
+        if (!pending_reserve(&d->out, n)) {
+            d->status = HUFF_NOMEM;
+            return true;
+        }
+        table_decode(d->table, &d->reader, d->out.buf, n);
+        d->out.len = n;
+        d->remaining -= n;
+        return true;
+    }
+    case DECODE_DONE: return false;
+    }
+    return false;
+}
+
+//
+// Feeds up to n bytes of compressed data at src to the decoder, and returns
+// how many were taken. At most a block of decompressed data is kept pending,
+// so fewer than n bytes are taken once output must be pulled to make room.
+//
+uint64_t huff_decoder_push(HuffDecoder *d, const uint8_t *src, uint64_t n) {
+    uint64_t taken = 0;
+    while (taken < n && d->status == HUFF_OK && !d->finishing) {
+        if (d->state == DECODE_DONE) {
+            return n; // Index, footer or trailing data, nothing more to decode
+        }
+        uint64_t want = decoder_wants(d);
+        if (want == 0) {
+            if (d->out.pos != d->out.len) {
+                break;
+            }
+            decoder_step(d);
+            continue;
+        }
+        uint64_t k = want < n - taken ? want : n - taken;
+        if (!pending_append(&d->in, src + taken, k)) {
+            d->status = HUFF_NOMEM;
+            break;
+        }
+        taken += k;
+    }
+    return taken;
+}
+
+// Marks the end of input
+void huff_decoder_finish(HuffDecoder *d) {
+    d->finishing = true;
+    return;
+}
+
+//
+// Moves up to cap bytes of decompressed data into dst, passing the number of
+// bytes back through size. Returns HUFF_END once all of the output has been
+// pulled, HUFF_OK if more may follow, and HUFF_CORRUPT if input ends early.
+//
+HuffStatus huff_decoder_pull(HuffDecoder *d, uint8_t *dst, uint64_t cap, uint64_t *size) {
+    *size = 0;
+    while (d->status == HUFF_OK) {
+        if (d->out.pos == d->out.len) {
+            if (!decoder_step(d)) {
+                break;
+            }
+        } else if (*size < cap) {
+            *size += pending_take(&d->out, dst + *size, cap - *size);
+        } else {
+            break;
+        }
+    }
+    if (d->status == HUFF_OK && d->out.pos == d->out.len) {
+        if (d->state == DECODE_DONE) {
+            return HUFF_END;
+        } else if (d->finishing) {
+            d->status = HUFF_CORRUPT; // Input ended in the middle of the file
+        }
+    }
+    return d->status;
+}
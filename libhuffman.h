@@ -0,0 +1,72 @@
+#ifndef __LIBHUFFMAN_H__
+#define __LIBHUFFMAN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Marks the functions exported by libhuffman.so, which is built with every
+// other symbol hidden
+#define HUFF_API __attribute__((visibility("default")))
+
+//
+// Reentrant interface to the Huffman coder, for compressing in-process
+// instead of running encode and decode.
+//
+// Compressed data is in the block format written by `encode -b`, and any
+// file written by encode can be decompressed, those coded with a dictionary
+// (`encode -d`) through huff_decoder_create_dict(). Every call works only on the
+// buffers and context passed to it, so separate contexts can be used from
+// separate threads at once.
+//
+// HUFF_OK: Call succeeded, more output may follow
+// HUFF_END: All output has been pulled
+// HUFF_NOMEM: Memory couldn't be allocated
+// HUFF_CORRUPT: Compressed data is malformed or truncated
+// HUFF_SPACE: Output buffer is too small
+// HUFF_ARGS: Invalid block size or code length limit, a range of a file
+//            which isn't in the block format, or a file coded with a
+//            dictionary the decoder wasn't given
+//
+typedef enum HuffStatus { HUFF_OK, HUFF_END, HUFF_NOMEM, HUFF_CORRUPT, HUFF_SPACE, HUFF_ARGS } HuffStatus;
+
+typedef struct HuffEncoder HuffEncoder;
+
+typedef struct HuffDecoder HuffDecoder;
+
+HUFF_API const char *huff_status_name(HuffStatus status);
+
+HUFF_API uint64_t huff_compress_bound(uint64_t n, uint32_t block_size);
+
+HUFF_API HuffStatus huff_compress(
+    const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap, uint64_t *size, uint32_t block_size, uint8_t limit);
+
+HUFF_API HuffStatus huff_decompressed_size(const uint8_t *src, uint64_t n, uint64_t *size);
+
+HUFF_API HuffStatus huff_decompress(const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap, uint64_t *size);
+
+HUFF_API HuffStatus huff_decompress_range(
+    const uint8_t *src, uint64_t n, uint64_t offset, uint64_t len, uint8_t *dst, uint64_t cap, uint64_t *size);
+
+HUFF_API HuffEncoder *huff_encoder_create(uint32_t block_size, uint8_t limit);
+
+HUFF_API void huff_encoder_delete(HuffEncoder **e);
+
+HUFF_API uint64_t huff_encoder_push(HuffEncoder *e, const uint8_t *src, uint64_t n);
+
+HUFF_API void huff_encoder_finish(HuffEncoder *e);
+
+HUFF_API HuffStatus huff_encoder_pull(HuffEncoder *e, uint8_t *dst, uint64_t cap, uint64_t *size);
+
+HUFF_API HuffDecoder *huff_decoder_create(void);
+
+HUFF_API HuffDecoder *huff_decoder_create_dict(const uint8_t lengths[256], uint32_t id);
+
+HUFF_API void huff_decoder_delete(HuffDecoder **d);
+
+HUFF_API uint64_t huff_decoder_push(HuffDecoder *d, const uint8_t *src, uint64_t n);
+
+HUFF_API void huff_decoder_finish(HuffDecoder *d);
+
+HUFF_API HuffStatus huff_decoder_pull(HuffDecoder *d, uint8_t *dst, uint64_t cap, uint64_t *size);
+
+#endif
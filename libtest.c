@@ -0,0 +1,137 @@
+#include "libhuffman.h"
+
+#include "dict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failed = 0;
+
+// Reports whether the test named name passed
+static void check(const char *name, bool passed) {
+    printf("%s: %s\n", passed ? "PASS" : "FAIL", name);
+    failed |= !passed;
+    return;
+}
+
+// Compresses empty input and checks which ranges of it can be decoded
+static void test_empty_range(void) {
+    uint8_t src[1] = { 0 };
+    uint8_t dst[1];
+    uint64_t cap = huff_compress_bound(0, 1 << 16);
+    uint8_t *coded = (uint8_t *) malloc(cap);
+    uint64_t n = 0;
+    uint64_t size = 1;
+    bool ok = coded && huff_compress(src, 0, coded, cap, &n, 1 << 16, 0) == HUFF_OK;
+    check("empty input compresses", ok);
+    check("empty range of empty input",
+        ok && huff_decompress_range(coded, n, 0, 0, dst, 0, &size) == HUFF_OK && size == 0);
+    check("range past empty input", ok && huff_decompress_range(coded, n, 0, 1, dst, 1, &size) == HUFF_ARGS);
+    check("range at an offset of empty input",
+        ok && huff_decompress_range(coded, n, 1, 0, dst, 0, &size) == HUFF_ARGS);
+    free(coded);
+    return;
+}
+
+// Reads all of the file at path into a new buffer, passing its size back
+// through size. Returns NULL if it can't be read.
+static uint8_t *read_file(const char *path, uint64_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    uint8_t *buf = NULL;
+    *size = 0;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long n = ftell(f);
+        buf = n >= 0 ? (uint8_t *) malloc(n ? (size_t) n : 1) : NULL;
+        if (buf && (fseek(f, 0, SEEK_SET) != 0 || fread(buf, 1, (size_t) n, f) != (size_t) n)) {
+            free(buf);
+            buf = NULL;
+        }
+        *size = buf ? (uint64_t) n : 0;
+    }
+    fclose(f);
+    return buf;
+}
+
+// Decodes the n bytes at src through the stream decoder d into dst, which has
+// room for cap bytes, passing the decompressed size back through size
+static HuffStatus stream_decode(
+    HuffDecoder *d, const uint8_t *src, uint64_t n, uint8_t *dst, uint64_t cap, uint64_t *size) {
+    HuffStatus status = HUFF_OK;
+    uint64_t taken = 0;
+    *size = 0;
+    while (status == HUFF_OK) {
+        uint64_t pushed = huff_decoder_push(d, src + taken, n - taken);
+        taken += pushed;
+        if (taken == n) {
+            huff_decoder_finish(d);
+        }
+        uint64_t pulled;
+        status = huff_decoder_pull(d, dst + *size, cap - *size, &pulled);
+        *size += pulled;
+        if (status == HUFF_OK && *size == cap && pushed == 0) {
+            status = HUFF_SPACE;
+        }
+    }
+    return status == HUFF_END ? HUFF_OK : status;
+}
+
+//
+// Decodes coded_path, the file at raw_path coded with encode -d, with the
+// dictionary of ID id in dir, and checks that it can't be decoded without
+// that dictionary
+//
+static void test_dict(const char *raw_path, const char *coded_path, const char *dir, uint32_t id) {
+    uint64_t raw_size = 0;
+    uint64_t coded_size = 0;
+    uint8_t *raw = read_file(raw_path, &raw_size);
+    uint8_t *coded = read_file(coded_path, &coded_size);
+    uint8_t *out = (uint8_t *) malloc(raw_size + 1);
+    Dictionary dict;
+    bool ok = raw && coded && out && dict_load(&dict, dir, id);
+    check("dictionary coded file and dictionary load", ok);
+
+    uint64_t size = 0;
+    check("dictionary coded file size",
+        ok && huff_decompressed_size(coded, coded_size, &size) == HUFF_OK && size == raw_size);
+
+    HuffDecoder *d = ok ? huff_decoder_create_dict(dict.lengths, id) : NULL;
+    check("dictionary coded file round trips",
+        d && stream_decode(d, coded, coded_size, out, raw_size + 1, &size) == HUFF_OK && size == raw_size
+            && memcmp(out, raw, raw_size) == 0);
+    huff_decoder_delete(&d);
+
+    d = ok ? huff_decoder_create_dict(dict.lengths, id + 1) : NULL;
+    check("dictionary coded file with another dictionary",
+        d && stream_decode(d, coded, coded_size, out, raw_size + 1, &size) == HUFF_ARGS);
+    huff_decoder_delete(&d);
+
+    check("dictionary coded file without a dictionary",
+        ok && huff_decompress(coded, coded_size, out, raw_size + 1, &size) == HUFF_ARGS);
+
+    uint8_t lengths[256];
+    memset(lengths, 1, sizeof(lengths));
+    check("dictionary which isn't a prefix code", huff_decoder_create_dict(lengths, id) == NULL);
+
+    free(raw);
+    free(coded);
+    free(out);
+    return;
+}
+
+//
+// Tests of the libhuffman interface, run by test.sh. Prints a line per test
+// and exits with a failure if any of them fails. Given a file, the file coded
+// with encode -d, and the directory and hex ID of the dictionary it was coded
+// with, the file is also decoded through the library.
+//
+int main(int argc, char **argv) {
+    test_empty_range();
+    if (argc == 5) {
+        test_dict(argv[1], argv[2], argv[3], (uint32_t) strtoul(argv[4], NULL, 16));
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define POOL_QUEUE 256 // Maximum number of tasks waiting to run
+
+//
+// Definition of struct Pool, a fixed set of worker threads which run tasks
+// taken from a circular queue.
+//
+// threads: Number of worker threads
+// workers: Worker thread handles
+// lock: Protects every field below it
+// queued: Signalled when a task is queued or the pool shuts down
+// drained: Signalled when a slot frees up in the queue or a task completes
+// head: Index of the next task to run
+// size: Number of tasks waiting in the queue
+// pending: Number of tasks queued or running
+// shutdown: Set to stop the workers
+// tasks, args: Queue of tasks and their arguments
+//
+struct Pool {
+    uint32_t threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t drained;
+    uint32_t head;
+    uint32_t size;
+    uint32_t pending;
+    bool shutdown;
+    Task tasks[POOL_QUEUE];
+    void *args[POOL_QUEUE];
+};
+
+// Worker thread: runs queued tasks until the pool shuts down
+static void *pool_worker(void *arg) {
+    Pool *p = (Pool *) arg;
+    pthread_mutex_lock(&p->lock);
+    while (true) {
+        while (p->size == 0 && !p->shutdown) {
+            pthread_cond_wait(&p->queued, &p->lock);
+        }
+        if (p->size == 0) {
+            break; // Shutting down and nothing left to run
+        }
+        Task task = p->tasks[p->head];
+        void *task_arg = p->args[p->head];
+        p->head = (p->head + 1) % POOL_QUEUE;
+        p->size -= 1;
+        pthread_cond_broadcast(&p->drained);
+
+        pthread_mutex_unlock(&p->lock);
+        task(task_arg);
+        pthread_mutex_lock(&p->lock);
+
+        p->pending -= 1;
+        pthread_cond_broadcast(&p->drained);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+//
+// Constructor for a thread pool - returns pointer to a pool running threads
+// workers, or NULL if the pool can't be created.
+//
+Pool *pool_create(uint32_t threads) {
+    Pool *p = (Pool *) calloc(1, sizeof(Pool));
+    if (p) {
+        p->threads = threads ? threads : 1;
+        p->workers = (pthread_t *) calloc(p->threads, sizeof(pthread_t));
+        if (!p->workers) {
+            free(p);
+            return NULL;
+        }
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->queued, NULL);
+        pthread_cond_init(&p->drained, NULL);
+        for (uint32_t i = 0; i < p->threads; i++) {
+            if (pthread_create(&p->workers[i], NULL, pool_worker, p) != 0) {
+                // Run with the workers started so far
+                p->threads = i;
+                break;
+            }
+        }
+        if (p->threads == 0) {
+            pool_delete(&p);
+        }
+    }
+    return p;
+}
+
+//
+// Destructor for a thread pool. Runs any tasks still queued, then joins the
+// worker threads.
+//
+void pool_delete(Pool **p) {
+    if (*p) {
+        pthread_mutex_lock(&(*p)->lock);
+        (*p)->shutdown = true;
+        pthread_cond_broadcast(&(*p)->queued);
+        pthread_mutex_unlock(&(*p)->lock);
+        for (uint32_t i = 0; i < (*p)->threads; i++) {
+            pthread_join((*p)->workers[i], NULL);
+        }
+        pthread_mutex_destroy(&(*p)->lock);
+        pthread_cond_destroy(&(*p)->queued);
+        pthread_cond_destroy(&(*p)->drained);
+        free((*p)->workers);
+        free(*p);
+        *p = NULL;
+    }
+    return;
+}
+
+//
+// Returns the number of worker threads in the pool
+//
+uint32_t pool_threads(Pool *p) {
+    return p->threads;
+}
+
+//
+// Queues task to be run with arg on a worker thread. Blocks while the queue
+// is full.
+//
+void pool_submit(Pool *p, Task task, void *arg) {
+    pthread_mutex_lock(&p->lock);
+    while (p->size == POOL_QUEUE) {
+        pthread_cond_wait(&p->drained, &p->lock);
+    }
+    uint32_t tail = (p->head + p->size) % POOL_QUEUE;
+    p->tasks[tail] = task;
+    p->args[tail] = arg;
+    p->size += 1;
+    p->pending += 1;
+    pthread_cond_signal(&p->queued);
+    pthread_mutex_unlock(&p->lock);
+    return;
+}
+
+//
+// Blocks until every task submitted so far has completed
+//
+void pool_wait(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0) {
+        pthread_cond_wait(&p->drained, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return;
+}
+
+//
+// Returns the number of online processors, the default number of threads
+//
+uint32_t default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t) n : 1;
+}
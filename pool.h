@@ -0,0 +1,23 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Pool Pool;
+
+typedef void (*Task)(void *arg);
+
+Pool *pool_create(uint32_t threads);
+
+void pool_delete(Pool **p);
+
+uint32_t pool_threads(Pool *p);
+
+void pool_submit(Pool *p, Task task, void *arg);
+
+void pool_wait(Pool *p);
+
+uint32_t default_threads(void);
+
+#endif
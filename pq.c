@@ -10,7 +10,7 @@ static inline uint32_t succ(uint32_t pos, uint32_t capacity) {
 }
 
 // Returns the previous position in the queue
-static inline uint8_t prev(uint32_t pos, uint32_t capacity) {
+static inline uint32_t prev(uint32_t pos, uint32_t capacity) {
     return ((pos + capacity - 1) % capacity);
 }
 
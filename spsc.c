@@ -0,0 +1,183 @@
+#include "spsc.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SPSC_SPINS 64 // Polls of the other side before sleeping.
+#define CACHE_LINE 64
+
+//
+// Definition of struct Spsc. head and tail count the chunks taken and given
+// since creation, so the ring holds tail - head chunks and slot i % slots
+// holds chunk i. Each is written by one side only and kept on its own cache
+// line, so the sides don't contend for a line they both write.
+//
+// A side which still has to wait after SPSC_SPINS polls sleeps on changed,
+// counted in sleepers. The other side only takes lock to wake it when
+// sleepers is set, so the ring stays lock-free while both sides keep up.
+//
+// slots: Number of chunks the ring holds
+// size: Bytes per chunk
+// buf: Chunk buffers, slots of them
+// lens: Bytes used in each chunk
+// lock: Held by a sleeping side, and to wake it
+// changed: Signalled when head, tail or stopped changes with a side asleep
+// head: Chunks taken by the consumer
+// tail: Chunks given by the producer
+// stopped: Set by the consumer to make the producer give up
+// sleepers: Number of sides sleeping on changed
+//
+struct Spsc {
+    uint32_t slots;
+    uint32_t size;
+    uint8_t *buf;
+    uint32_t *lens;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    _Alignas(CACHE_LINE) uint32_t head;
+    _Alignas(CACHE_LINE) uint32_t tail;
+    _Alignas(CACHE_LINE) bool stopped;
+    uint32_t sleepers;
+};
+
+//
+// Sleeps until *counter no longer equals value or, if stoppable, the ring is
+// stopped. The sleeper is counted before the check, and the other side
+// stores before it looks for sleepers, so one of them always sees the other.
+//
+static void spsc_sleep(Spsc *r, uint32_t *counter, uint32_t value, bool stoppable) {
+    pthread_mutex_lock(&r->lock);
+    __atomic_add_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(counter, __ATOMIC_SEQ_CST) == value
+           && !(stoppable && __atomic_load_n(&r->stopped, __ATOMIC_SEQ_CST))) {
+        pthread_cond_wait(&r->changed, &r->lock);
+    }
+    __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+    return;
+}
+
+// Wakes the other side if it is sleeping, after a change to the ring
+static void spsc_wake(Spsc *r) {
+    if (__atomic_load_n(&r->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->changed);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return;
+}
+
+//
+// Constructor for a ring - returns a pointer to a ring of slots chunks of
+// size bytes each, or NULL if memory can't be allocated.
+//
+Spsc *spsc_create(uint32_t slots, uint32_t size) {
+    Spsc *r = (Spsc *) aligned_alloc(CACHE_LINE, sizeof(Spsc));
+    if (!r) {
+        return NULL;
+    }
+    r->slots = slots;
+    r->size = size;
+    r->buf = (uint8_t *) malloc((size_t) slots * size);
+    r->lens = (uint32_t *) calloc(slots, sizeof(uint32_t));
+    r->head = 0;
+    r->tail = 0;
+    r->stopped = false;
+    r->sleepers = 0;
+    if (!r->buf || !r->lens) {
+        free(r->buf);
+        free(r->lens);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    return r;
+}
+
+//
+// Destructor for a ring. Neither side may be using it.
+//
+void spsc_delete(Spsc **r) {
+    if (*r) {
+        pthread_mutex_destroy(&(*r)->lock);
+        pthread_cond_destroy(&(*r)->changed);
+        free((*r)->buf);
+        free((*r)->lens);
+        free(*r);
+        *r = NULL;
+    }
+    return;
+}
+
+// Returns the number of bytes per chunk
+uint32_t spsc_size(Spsc *r) {
+    return r->size;
+}
+
+//
+// Producer: returns the next empty chunk to fill, waiting while the ring is
+// full. Returns NULL if the consumer has stopped the ring, checked on every
+// call so a producer stops even while the consumer keeps up.
+//
+uint8_t *spsc_reserve(Spsc *r) {
+    uint32_t tail = r->tail;
+    for (uint32_t spins = 0;; spins++) {
+        if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        } else if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->slots) {
+            break;
+        }
+        if (spins >= SPSC_SPINS) {
+            spsc_sleep(r, &r->head, tail - r->slots, true);
+        }
+    }
+    return r->buf + (size_t) (tail % r->slots) * r->size;
+}
+
+//
+// Producer: hands the chunk from spsc_reserve() to the consumer with len
+// bytes in it. A chunk of 0 bytes marks the end of the data.
+//
+void spsc_commit(Spsc *r, uint32_t len) {
+    r->lens[r->tail % r->slots] = len;
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    spsc_wake(r);
+    return;
+}
+
+//
+// Consumer: returns the next chunk given by the producer and passes back its
+// length through len, waiting while the ring is empty. The chunk stays valid
+// until spsc_pop().
+//
+uint8_t *spsc_front(Spsc *r, uint32_t *len) {
+    uint32_t head = r->head;
+    for (uint32_t spins = 0; __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head; spins++) {
+        if (spins >= SPSC_SPINS) {
+            spsc_sleep(r, &r->tail, head, false);
+        }
+    }
+    uint32_t i = head % r->slots;
+    *len = r->lens[i];
+    return r->buf + (size_t) i * r->size;
+}
+
+//
+// Consumer: gives the chunk from spsc_front() back to the producer
+//
+void spsc_pop(Spsc *r) {
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+    spsc_wake(r);
+    return;
+}
+
+//
+// Consumer: tells the producer no more chunks will be taken, so that its
+// next spsc_reserve() gives up, waking it if it is waiting on a full ring
+//
+void spsc_stop(Spsc *r) {
+    __atomic_store_n(&r->stopped, true, __ATOMIC_SEQ_CST);
+    spsc_wake(r);
+    return;
+}
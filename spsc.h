@@ -0,0 +1,31 @@
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Lock-free ring of fixed size chunks passed from one producer thread to one
+// consumer thread. A full ring makes the producer wait, so a slow consumer
+// holds back a fast producer instead of letting chunks pile up. A side which
+// waits for long sleeps instead of polling.
+//
+typedef struct Spsc Spsc;
+
+Spsc *spsc_create(uint32_t slots, uint32_t size);
+
+void spsc_delete(Spsc **r);
+
+uint32_t spsc_size(Spsc *r);
+
+uint8_t *spsc_reserve(Spsc *r);
+
+void spsc_commit(Spsc *r, uint32_t len);
+
+uint8_t *spsc_front(Spsc *r, uint32_t *len);
+
+void spsc_pop(Spsc *r);
+
+void spsc_stop(Spsc *r);
+
+#endif
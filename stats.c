@@ -0,0 +1,373 @@
+#include "stats.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define STATS_PHASES   16 // Most phases recorded
+#define STATS_FIELDS   16 // Most extra fields recorded
+#define STATS_COUNTERS 3 // Hardware counters: cycles, instructions, branch misses
+
+static const char *counter_names[STATS_COUNTERS] = { "cycles", "instructions", "branch_misses" };
+
+//
+// A snapshot of everything measured, taken at the start and end of a phase.
+//
+// wall, cpu: Monotonic time, and CPU time of all threads, in seconds
+// user, sys: User and system CPU time of all threads, in seconds
+// minflt, majflt: Page faults which did and didn't need I/O
+// nvcsw, nivcsw: Voluntary and involuntary context switches
+// syscr, syscw: Read and write system calls (from /proc/self/io)
+// rchar, wchar: Bytes moved by those calls
+// counters: Hardware counters of the thread which created the stats and
+//           the threads it started since, once they have exited
+//
+typedef struct Sample {
+    double wall;
+    double cpu;
+    double user;
+    double sys;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t nvcsw;
+    uint64_t nivcsw;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t counters[STATS_COUNTERS];
+} Sample;
+
+//
+// A named phase and what it used: the difference between its end and start
+// samples.
+//
+typedef struct PhaseStats {
+    const char *name;
+    Sample used;
+} PhaseStats;
+
+//
+// An extra field of the output, holding a number or (if str isn't NULL) a
+// string.
+//
+typedef struct Field {
+    const char *key;
+    const char *str;
+    uint64_t value;
+} Field;
+
+//
+// Definition of struct Stats.
+//
+// program: Name of the program being measured
+// fds: perf_event file descriptors for each counter, -1 if not counting
+// start: Sample taken at creation, for the totals
+// phase_start: Sample taken at the start of the current phase
+// phases, nphases: Finished phases
+// current: Name of the current phase, NULL between phases
+// fields, nfields: Extra fields
+// own_calls, own_bytes: Reads taken by sampling itself, kept out of the counts
+//
+struct Stats {
+    const char *program;
+    int fds[STATS_COUNTERS];
+    Sample start;
+    Sample phase_start;
+    PhaseStats phases[STATS_PHASES];
+    uint32_t nphases;
+    const char *current;
+    Field fields[STATS_FIELDS];
+    uint32_t nfields;
+    uint64_t own_calls;
+    uint64_t own_bytes;
+};
+
+// Returns a clock reading in seconds
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns the value of the field key in the contents of /proc/self/io
+static uint64_t proc_field(const char *buf, const char *key) {
+    const char *p = strstr(buf, key);
+    return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+// Reads the system call counts from /proc/self/io, leaving them 0 where it
+// doesn't exist. The counts don't include this read, but do include every
+// read taken for earlier samples, which are taken off.
+static void read_proc_io(Stats *s, Sample *sample) {
+    char buf[512];
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+    buf[n] = '\0';
+    sample->syscr = proc_field(buf, "syscr:") - s->own_calls;
+    sample->syscw = proc_field(buf, "syscw:");
+    sample->rchar = proc_field(buf, "rchar:") - s->own_bytes;
+    sample->wchar = proc_field(buf, "wchar:");
+    s->own_calls += 1;
+    s->own_bytes += n;
+    return;
+}
+
+// Takes a sample of everything measured
+static void sample_take(Stats *s, Sample *sample) {
+    memset(sample, 0, sizeof(Sample));
+    sample->wall = clock_seconds(CLOCK_MONOTONIC);
+    sample->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        sample->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6;
+        sample->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+        sample->minflt = usage.ru_minflt;
+        sample->majflt = usage.ru_majflt;
+        sample->nvcsw = usage.ru_nvcsw;
+        sample->nivcsw = usage.ru_nivcsw;
+    }
+    read_proc_io(s, sample);
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        uint64_t value = 0;
+        if (s->fds[i] >= 0 && read(s->fds[i], &value, sizeof(value)) == sizeof(value)) {
+            sample->counters[i] = value;
+            s->own_calls += 1;
+            s->own_bytes += sizeof(value);
+        }
+    }
+    return;
+}
+
+// Sets used to what was used between the samples start and end
+static void sample_diff(Sample *used, Sample *start, Sample *end) {
+    used->wall = end->wall - start->wall;
+    used->cpu = end->cpu - start->cpu;
+    used->user = end->user - start->user;
+    used->sys = end->sys - start->sys;
+    used->minflt = end->minflt - start->minflt;
+    used->majflt = end->majflt - start->majflt;
+    used->nvcsw = end->nvcsw - start->nvcsw;
+    used->nivcsw = end->nivcsw - start->nivcsw;
+    used->syscr = end->syscr - start->syscr;
+    used->syscw = end->syscw - start->syscw;
+    used->rchar = end->rchar - start->rchar;
+    used->wchar = end->wchar - start->wchar;
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        used->counters[i] = end->counters[i] - start->counters[i];
+    }
+    return;
+}
+
+// Opens a user space hardware counter for the calling thread and the threads
+// it starts later, such as those of a pool, whose counts are added when they
+// exit. Returns -1 if the kernel or machine doesn't allow it.
+static int counter_open(uint64_t config) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void) config;
+    return -1;
+#endif
+}
+
+//
+// Constructor for stats of program, starting the clock. If counters is set,
+// hardware counters are opened for the calling thread and the threads it
+// starts, where the kernel allows it. Returns NULL if memory can't be
+// allocated.
+//
+Stats *stats_create(const char *program, bool counters) {
+    Stats *s = (Stats *) calloc(1, sizeof(Stats));
+    if (!s) {
+        return NULL;
+    }
+    s->program = program;
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        s->fds[i] = -1;
+    }
+#ifdef __linux__
+    if (counters) {
+        s->fds[0] = counter_open(PERF_COUNT_HW_CPU_CYCLES);
+        s->fds[1] = counter_open(PERF_COUNT_HW_INSTRUCTIONS);
+        s->fds[2] = counter_open(PERF_COUNT_HW_BRANCH_MISSES);
+    }
+#else
+    (void) counters;
+#endif
+    sample_take(s, &s->start);
+    return s;
+}
+
+// Destructor for stats
+void stats_delete(Stats **s) {
+    if (*s) {
+        for (int i = 0; i < STATS_COUNTERS; i++) {
+            if ((*s)->fds[i] >= 0) {
+                close((*s)->fds[i]);
+            }
+        }
+        free(*s);
+        *s = NULL;
+    }
+    return;
+}
+
+// Starts timing a phase, ending the current one first. phase must outlive s.
+void stats_begin(Stats *s, const char *phase) {
+    if (!s) {
+        return;
+    }
+    stats_end(s);
+    s->current = phase;
+    sample_take(s, &s->phase_start);
+    return;
+}
+
+// Ends the current phase, if any
+void stats_end(Stats *s) {
+    if (!s || !s->current) {
+        return;
+    }
+    Sample end;
+    sample_take(s, &end);
+    if (s->nphases < STATS_PHASES) {
+        s->phases[s->nphases].name = s->current;
+        sample_diff(&s->phases[s->nphases].used, &s->phase_start, &end);
+        s->nphases += 1;
+    }
+    s->current = NULL;
+    return;
+}
+
+// Adds a numeric field to the output, or replaces the one with the same key
+void stats_set(Stats *s, const char *key, uint64_t value) {
+    if (!s) {
+        return;
+    }
+    uint32_t i = 0;
+    while (i < s->nfields && strcmp(s->fields[i].key, key) != 0) {
+        i += 1;
+    }
+    if (i < STATS_FIELDS) {
+        s->fields[i].key = key;
+        s->fields[i].str = NULL;
+        s->fields[i].value = value;
+        s->nfields = i == s->nfields ? i + 1 : s->nfields;
+    }
+    return;
+}
+
+// Adds a string field to the output. key and value must outlive s and need
+// no escaping.
+void stats_set_str(Stats *s, const char *key, const char *value) {
+    if (!s) {
+        return;
+    }
+    stats_set(s, key, 0);
+    for (uint32_t i = 0; i < s->nfields; i++) {
+        if (strcmp(s->fields[i].key, key) == 0) {
+            s->fields[i].str = value;
+        }
+    }
+    return;
+}
+
+// Writes the members of a sample to f
+static void sample_print(Stats *s, Sample *used, FILE *f, const char *indent) {
+    fprintf(f, "%s\"wall_s\": %.6f,\n", indent, used->wall);
+    fprintf(f, "%s\"cpu_s\": %.6f,\n", indent, used->cpu);
+    fprintf(f, "%s\"user_s\": %.6f,\n", indent, used->user);
+    fprintf(f, "%s\"sys_s\": %.6f,\n", indent, used->sys);
+    fprintf(f, "%s\"minor_faults\": %" PRIu64 ",\n", indent, used->minflt);
+    fprintf(f, "%s\"major_faults\": %" PRIu64 ",\n", indent, used->majflt);
+    fprintf(f, "%s\"voluntary_switches\": %" PRIu64 ",\n", indent, used->nvcsw);
+    fprintf(f, "%s\"involuntary_switches\": %" PRIu64 ",\n", indent, used->nivcsw);
+    fprintf(f, "%s\"read_calls\": %" PRIu64 ",\n", indent, used->syscr);
+    fprintf(f, "%s\"write_calls\": %" PRIu64 ",\n", indent, used->syscw);
+    fprintf(f, "%s\"read_bytes\": %" PRIu64 ",\n", indent, used->rchar);
+    fprintf(f, "%s\"write_bytes\": %" PRIu64, indent, used->wchar);
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        if (s->fds[i] >= 0) {
+            fprintf(f, ",\n%s\"%s\": %" PRIu64, indent, counter_names[i], used->counters[i]);
+        }
+    }
+    fprintf(f, "\n");
+    return;
+}
+
+//
+// Ends the current phase and writes everything as a JSON object to path, or
+// to stderr if path is "-". Totals cover the time since stats_create(). Read
+// and write calls and bytes count every system call moving data, including
+// those of other threads; hardware counters cover the thread which called
+// stats_create() and the worker threads it started afterwards, counted once
+// they exit. Returns false if the file can't be written.
+//
+bool stats_write(Stats *s, const char *path) {
+    if (!s) {
+        return true;
+    }
+    stats_end(s);
+    Sample end, total;
+    sample_take(s, &end);
+    sample_diff(&total, &s->start, &end);
+
+    FILE *f = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    struct rusage usage;
+    uint64_t peak_rss = getrusage(RUSAGE_SELF, &usage) == 0 ? (uint64_t) usage.ru_maxrss : 0;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"program\": \"%s\",\n", s->program);
+    for (uint32_t i = 0; i < s->nfields; i++) {
+        if (s->fields[i].str) {
+            fprintf(f, "  \"%s\": \"%s\",\n", s->fields[i].key, s->fields[i].str);
+        } else {
+            fprintf(f, "  \"%s\": %" PRIu64 ",\n", s->fields[i].key, s->fields[i].value);
+        }
+    }
+    fprintf(f, "  \"peak_rss_kb\": %" PRIu64 ",\n", peak_rss);
+    fprintf(f, "  \"counters\": %s,\n", s->fds[0] >= 0 || s->fds[1] >= 0 || s->fds[2] >= 0 ? "true" : "false");
+    fprintf(f, "  \"total\": {\n");
+    sample_print(s, &total, f, "    ");
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"phases\": [");
+    for (uint32_t i = 0; i < s->nphases; i++) {
+        fprintf(f, "%s\n    {\n", i ? "," : "");
+        fprintf(f, "      \"name\": \"%s\",\n", s->phases[i].name);
+        sample_print(s, &s->phases[i].used, f, "      ");
+        fprintf(f, "    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    bool ok = !ferror(f);
+    if (f != stderr) {
+        ok = fclose(f) == 0 && ok;
+    }
+    return ok;
+}
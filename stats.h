@@ -0,0 +1,28 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Per-phase measurements of a run, written out as JSON. Every function
+// accepts a NULL Stats and does nothing, so call sites don't need to check
+// whether stats were asked for.
+//
+typedef struct Stats Stats;
+
+Stats *stats_create(const char *program, bool counters);
+
+void stats_delete(Stats **s);
+
+void stats_begin(Stats *s, const char *phase);
+
+void stats_end(Stats *s);
+
+void stats_set(Stats *s, const char *key, uint64_t value);
+
+void stats_set_str(Stats *s, const char *key, const char *value);
+
+bool stats_write(Stats *s, const char *path);
+
+#endif
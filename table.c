@@ -0,0 +1,260 @@
+#include "table.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+// Fills in the entries for every leaf of the subtree at child value node.
+// code holds the depth bits of the path taken from the root, first bit least
+// significant.
+static void table_fill(DecodeTable *t, uint16_t node, uint32_t code, uint32_t depth) {
+    if (node & FLAT_LEAF) {
+        // Leaf: every index whose low depth bits match the code decodes to it
+        DecodeEntry e = { .symbol = (uint8_t) node, .length = (uint8_t) depth };
+        for (uint32_t i = code; i < (1 << DECODE_BITS); i += 1 << depth) {
+            t->entries[i] = e;
+        }
+        return;
+    } else if (depth == DECODE_BITS) {
+        // Code is longer than the table width, entry stays as a slow path marker
+        return;
+    } else {
+        table_fill(t, t->tree->nodes[node][0], code, depth + 1);
+        table_fill(t, t->tree->nodes[node][1], code | (1 << depth), depth + 1);
+        return;
+    }
+}
+
+//
+// Fills in the multi-symbol entries from the single symbol entries. After
+// taking the first code of an index, the rest of the index is looked up
+// shifted down by its length. The high bits that shifts in are unknown, so a
+// further code is only taken if it fits in the bits still known.
+//
+static void table_build_multi(DecodeTable *t) {
+    for (uint32_t i = 0; i < (1 << DECODE_BITS); i++) {
+        MultiEntry m = { .length = 0, .count = 0 };
+        while (m.count < MULTI_SYMBOLS) {
+            DecodeEntry e = t->entries[i >> m.length];
+            if (e.length == 0 || m.length + e.length > DECODE_BITS) {
+                break;
+            }
+            m.symbols[m.count++] = e.symbol;
+            m.length += e.length;
+        }
+        t->multi[i] = m;
+    }
+    return;
+}
+
+// Builds the decode table for the flattened Huffman tree
+void table_build(DecodeTable *t, FlatTree *tree) {
+    t->tree = tree;
+    for (uint32_t i = 0; i < (1 << DECODE_BITS); i++) {
+        t->entries[i].symbol = 0;
+        t->entries[i].length = 0;
+    }
+    table_fill(t, tree->root, 0, 0);
+    table_build_multi(t);
+    return;
+}
+
+// Builds the decode table for canonical codes with the given code lengths
+void table_build_canonical(DecodeTable *t, uint8_t lengths[static ALPHABET]) {
+    Code codes[ALPHABET] = { 0 };
+    canonical_codes(lengths, codes);
+
+    t->tree = NULL;
+    t->max_length = 0;
+    for (uint32_t i = 0; i < (1 << DECODE_BITS); i++) {
+        t->entries[i].symbol = 0;
+        t->entries[i].length = 0;
+    }
+    for (int len = 0; len < ALPHABET; len++) {
+        t->counts[len] = 0;
+    }
+
+    // Fill the table with the short codes, and list symbols in canonical order
+    uint32_t n = 0;
+    for (int len = 1; len < ALPHABET; len++) {
+        for (int i = 0; i < ALPHABET; i++) {
+            if (lengths[i] != len) {
+                continue;
+            }
+            t->counts[len] += 1;
+            t->symbols[n++] = (uint8_t) i;
+            t->max_length = (uint8_t) len;
+            if (len <= DECODE_BITS) {
+                DecodeEntry e = { .symbol = (uint8_t) i, .length = (uint8_t) len };
+                uint32_t code = (uint32_t) packed_bits(code_pack(&codes[i]));
+                for (uint32_t j = code; j < (1 << DECODE_BITS); j += 1 << len) {
+                    t->entries[j] = e;
+                }
+            }
+        }
+    }
+    table_build_multi(t);
+    return;
+}
+
+//
+// Resolves a canonical code a bit at a time. offset tracks how far the code
+// read so far is past the first code of the current length, so it stays
+// small even for codes much longer than a machine word.
+//
+static uint8_t table_decode_canonical(DecodeTable *t, BitReader *r) {
+    uint32_t offset = 0;
+    uint32_t index = 0; // Index in symbols of the first code of the current length
+    for (uint32_t len = 1; len <= t->max_length; len++) {
+        if (r->count == 0) {
+            bit_reader_refill(r);
+        }
+        offset |= (uint32_t) bit_reader_peek(r, 1);
+        bit_reader_consume(r, 1);
+        if (offset < t->counts[len]) {
+            return t->symbols[index + offset];
+        }
+        index += t->counts[len];
+        offset = (offset - t->counts[len]) << 1;
+        if (offset > 2 * ALPHABET) {
+            break; // Corrupt input, no code can match
+        }
+    }
+    return 0;
+}
+
+// Resolves a code longer than DECODE_BITS by walking the tree a bit at a time
+static uint8_t table_decode_slow(DecodeTable *t, BitReader *r) {
+    if (t->tree == NULL) {
+        return table_decode_canonical(t, r);
+    }
+    uint16_t node = t->tree->root;
+    while (!(node & FLAT_LEAF)) {
+        if (r->count == 0) {
+            bit_reader_refill(r);
+        }
+        node = t->tree->nodes[node][bit_reader_peek(r, 1)];
+        bit_reader_consume(r, 1);
+    }
+    return (uint8_t) node;
+}
+
+// Takes the next lookup of r into out, returning the number of symbols
+// decoded. out must have room for MULTI_SYMBOLS bytes, and r at least
+// DECODE_BITS bits buffered. A slow path code leaves at least 56 bits
+// buffered, so the caller's lookups can carry on without checking.
+static inline uint32_t table_decode_multi(DecodeTable *t, BitReader *r, uint8_t *out) {
+    MultiEntry m = t->multi[bit_reader_peek(r, DECODE_BITS)];
+    if (m.length) {
+        memcpy(out, m.symbols, MULTI_SYMBOLS);
+        bit_reader_consume(r, m.length);
+        return m.count;
+    }
+    *out = table_decode_slow(t, r);
+    bit_reader_refill(r);
+    return 1;
+}
+
+//
+// Decodes nsymbols symbols from r into out. Each refill leaves at least 56
+// bits buffered, enough for several table lookups before refilling again.
+// Lookups take as many symbols as the multi-symbol table gives while there
+// is room to store them whole, and the last few symbols one at a time.
+//
+void table_decode(DecodeTable *t, BitReader *r, uint8_t *out, uint64_t nsymbols) {
+    // Work on a copy of the reader, which stores to out can't alias
+    BitReader s = *r;
+    uint64_t i = 0;
+    while (i + MULTI_SYMBOLS <= nsymbols) {
+        bit_reader_refill(&s);
+        while (s.count >= DECODE_BITS && i + MULTI_SYMBOLS <= nsymbols) {
+            i += table_decode_multi(t, &s, out + i);
+        }
+    }
+    while (i < nsymbols) {
+        bit_reader_refill(&s);
+        while (s.count >= DECODE_BITS && i < nsymbols) {
+            DecodeEntry e = t->entries[bit_reader_peek(&s, DECODE_BITS)];
+            if (e.length) {
+                out[i] = e.symbol;
+                bit_reader_consume(&s, e.length);
+            } else {
+                out[i] = table_decode_slow(t, &s);
+            }
+            i += 1;
+        }
+    }
+    *r = s;
+    return;
+}
+
+//
+// Decodes nsymbols symbols from r into out, each with the table of tables
+// which map gives for the symbol before it, starting from a 0 (see
+// BLOCK_CONTEXT). The table of each symbol depends on the last, so symbols
+// are taken one lookup at a time.
+//
+void table_decode_context(
+    DecodeTable *tables, uint8_t map[static ALPHABET], BitReader *r, uint8_t *out, uint64_t nsymbols) {
+    BitReader s = *r;
+    uint8_t prev = 0;
+    uint64_t i = 0;
+    while (i < nsymbols) {
+        bit_reader_refill(&s);
+        while (s.count >= DECODE_BITS && i < nsymbols) {
+            DecodeTable *t = &tables[map[prev]];
+            DecodeEntry e = t->entries[bit_reader_peek(&s, DECODE_BITS)];
+            if (e.length) {
+                prev = e.symbol;
+                bit_reader_consume(&s, e.length);
+            } else {
+                prev = table_decode_slow(t, &s);
+            }
+            out[i++] = prev;
+        }
+    }
+    *r = s;
+    return;
+}
+
+//
+// Decodes nsymbols symbols from the STREAMS bitstreams of r into out, the
+// first STREAMS - 1 streams holding nsymbols / STREAMS symbols each and the
+// last the rest (see BLOCK_STREAMS). The streams are stepped together, so the
+// lookups of different streams don't wait on each other and can run at once.
+// After refilling, each stream has room for 56 / DECODE_BITS lookups.
+//
+void table_decode_streams(DecodeTable *t, BitReader r[static STREAMS], uint8_t *out, uint64_t nsymbols) {
+    enum { STEPS = 56 / DECODE_BITS };
+    uint64_t len = nsymbols / STREAMS;
+    BitReader s[STREAMS];
+    uint8_t *next[STREAMS];
+    uint8_t *end[STREAMS];
+    for (uint32_t k = 0; k < STREAMS; k++) {
+        s[k] = r[k];
+        next[k] = out + k * len;
+        end[k] = k == STREAMS - 1 ? out + nsymbols : next[k] + len;
+    }
+    for (;;) {
+        // Stop once any stream might not have room for a whole round
+        bool room = true;
+        for (uint32_t k = 0; k < STREAMS; k++) {
+            room = room && end[k] - next[k] >= STEPS * MULTI_SYMBOLS;
+        }
+        if (!room) {
+            break;
+        }
+        for (uint32_t k = 0; k < STREAMS; k++) {
+            bit_reader_refill(&s[k]);
+        }
+        for (uint32_t j = 0; j < STEPS; j++) {
+            for (uint32_t k = 0; k < STREAMS; k++) {
+                next[k] += table_decode_multi(t, &s[k], next[k]);
+            }
+        }
+    }
+    for (uint32_t k = 0; k < STREAMS; k++) {
+        table_decode(t, &s[k], next[k], end[k] - next[k]);
+        r[k] = s[k];
+    }
+    return;
+}
@@ -0,0 +1,62 @@
+#ifndef __TABLE_H__
+#define __TABLE_H__
+
+#include "defines.h"
+#include "huffman.h"
+#include "io.h"
+
+#include <stdint.h>
+
+//
+// Entry of the decode table. length is the number of bits of the code for
+// symbol, or 0 if the code is longer than DECODE_BITS and the rest of the
+// code must be resolved by walking the tree.
+//
+typedef struct DecodeEntry {
+    uint8_t symbol;
+    uint8_t length;
+} DecodeEntry;
+
+//
+// Entry of the multi-symbol decode table: the count symbols whose codes
+// together take the length bits at the start of the index, as many as fit in
+// DECODE_BITS bits, up to MULTI_SYMBOLS. length is 0 if the first code is
+// longer than DECODE_BITS.
+//
+typedef struct MultiEntry {
+    uint8_t symbols[MULTI_SYMBOLS];
+    uint8_t length;
+    uint8_t count;
+} MultiEntry;
+
+//
+// Lookup table indexed by the next DECODE_BITS bits of input. Every code of
+// at most DECODE_BITS bits is resolved with a single lookup, and multi
+// resolves runs of short codes at once, so skewed data with codes of a few
+// bits takes a lookup per several symbols.
+//
+// Longer codes are resolved by walking tree, or for canonical codes (tree is
+// NULL) from counts, the number of codes of each length, and
+// symbols, the symbols in canonical order.
+//
+typedef struct DecodeTable {
+    DecodeEntry entries[1 << DECODE_BITS];
+    MultiEntry multi[1 << DECODE_BITS];
+    FlatTree *tree;
+    uint8_t max_length;
+    uint16_t counts[ALPHABET];
+    uint8_t symbols[ALPHABET];
+} DecodeTable;
+
+void table_build(DecodeTable *t, FlatTree *tree);
+
+void table_build_canonical(DecodeTable *t, uint8_t lengths[static ALPHABET]);
+
+void table_decode(DecodeTable *t, BitReader *r, uint8_t *out, uint64_t nsymbols);
+
+void table_decode_context(
+    DecodeTable *tables, uint8_t map[static ALPHABET], BitReader *r, uint8_t *out, uint64_t nsymbols);
+
+void table_decode_streams(DecodeTable *t, BitReader r[static STREAMS], uint8_t *out, uint64_t nsymbols);
+
+#endif
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Regression tests for encode, decode and libhuffman, run by `make test`.
+# Prints a line per test and exits with a failure if any of them fails.
+#
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# Runs the command after the test name, and reports whether it succeeded
+check() {
+    name=$1
+    shift
+    if "$@"; then
+        echo "PASS: $name"
+    else
+        echo "FAIL: $name"
+        failed=1
+    fi
+}
+
+seq 1 50000 > "$dir/input"
+tail -c +101 "$dir/input" > "$dir/rest"
+
+# Encodes stdin from 100 bytes in, as left by a command run before encode,
+# and checks that only the bytes from there on come back
+from_offset() {
+    { dd of=/dev/null bs=100 count=1 2> /dev/null; ./encode "$@" -o "$dir/offset.huf"; } < "$dir/input" &&
+        ./decode -i "$dir/offset.huf" -o "$dir/offset.out" && cmp -s "$dir/offset.out" "$dir/rest"
+}
+
+for backend in read pread mmap uring; do
+    check "tree coded from an offset ($backend)" from_offset -m "$backend"
+    check "canonical coded from an offset ($backend)" from_offset -c -m "$backend"
+    check "single threaded from an offset ($backend)" from_offset -c -t 1 -m "$backend"
+    check "block coded from an offset ($backend)" from_offset -b 16 -m "$backend"
+done
+
+# Decodes a block coded file from a pipe which is left open after it, which
+# must finish at the end marker rather than wait for the pipe to close
+from_open_pipe() {
+    ./encode -b 16 -i "$dir/input" -o "$dir/pipe.huf" && mkfifo "$dir/fifo" || return 1
+    ./decode "$@" -o "$dir/pipe.out" < "$dir/fifo" &
+    pid=$!
+    exec 3> "$dir/fifo"
+    cat "$dir/pipe.huf" >&3
+    tries=0
+    while kill -0 $pid 2> /dev/null && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    exec 3>&-
+    wait $pid
+    status=$?
+    rm -f "$dir/fifo"
+    [ $status -eq 0 ] && [ $tries -lt 50 ] && cmp -s "$dir/pipe.out" "$dir/input"
+}
+
+check "block coded from an open pipe" from_open_pipe -t 1
+check "block coded from an open pipe, pipelined" from_open_pipe -t 4
+
+# A directory opens but can't be read, which must fail rather than count as
+# an empty file
+check "train read error" sh -c "! ./train -D '$dir' '$dir' 2> /dev/null"
+check "codegen read error" sh -c "! ./codegen -o '$dir' '$dir' 2> /dev/null"
+check "entropy read error" sh -c "! ./entropy -i '$dir' > /dev/null 2>&1"
+
+id=$(./train -D "$dir" "$dir/input") &&
+    ./encode -d "$id" -D "$dir" -i "$dir/input" -o "$dir/dict.huf" || failed=1
+./libtest "$dir/input" "$dir/dict.huf" "$dir" "$id" || failed=1
+
+exit $failed
@@ -0,0 +1,124 @@
+#include "defines.h"
+#include "dict.h"
+#include "histogram.h"
+#include "huffman.h"
+#include "io.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define OPTIONS "hvl:D:"
+
+static void usage(char *exec) {
+    fprintf(stderr,
+        "SYNOPSIS\n"
+        "  A dictionary training program.\n"
+        "  Builds a code table from a sample corpus and saves it as a dictionary\n"
+        "  for encode -d and decode, which then skip the histogram pass and\n"
+        "  the code table header.\n"
+        "\n"
+        "USAGE\n"
+        "  %s [-h] [-v] [-l limit] [-D dir] [file ...]\n"
+        "\n"
+        "OPTIONS\n"
+        "  -h               Program usage and help.\n"
+        "  -v               Print statistics of the corpus.\n"
+        "  -l limit         Code length limit, as for encode -l.\n"
+        "  -D dir           Directory to save the dictionary in (default: .).\n"
+        "  file ...         Corpus files (default: stdin).\n"
+        "\n"
+        "The dictionary is saved as dir/<id>.dict and its ID printed.\n",
+        exec);
+    return;
+}
+
+// Adds the bytes of infile to hist. Returns the number of bytes read, or -1
+// on a read error.
+static int64_t count_file(uint64_t hist[static ALPHABET], int infile, uint8_t *buf) {
+    int64_t total = 0;
+    int bytes = 0;
+    while ((bytes = read_bytes(infile, buf, READ_BUFFER)) > 0) {
+        histogram_add(hist, buf, bytes);
+        total += bytes;
+    }
+    return bytes < 0 ? -1 : total;
+}
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+    uint32_t limit = 0;
+    const char *dir = ".";
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': usage(argv[0]); return EXIT_SUCCESS;
+        case 'v': verbose = true; break;
+        case 'l':
+            limit = strtoul(optarg, NULL, 10);
+            if (limit < 8 || limit > PACKED_BITS) {
+                fprintf(stderr, "Code length limit must be from 8 to %d bits.\n", PACKED_BITS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D': dir = optarg; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    uint8_t *buf = (uint8_t *) malloc(READ_BUFFER);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Count the whole corpus into a single histogram
+    uint64_t hist[ALPHABET] = { 0 };
+    uint64_t total = 0;
+    for (int i = optind; i < argc || (i == optind && optind == argc); i++) {
+        int infile = i < argc ? open(argv[i], O_RDONLY) : STDIN_FILENO;
+        if (infile == -1) {
+            fprintf(stderr, "Error opening %s.\n", argv[i]);
+            free(buf);
+            return EXIT_FAILURE;
+        }
+        int64_t bytes = count_file(hist, infile, buf);
+        if (infile != STDIN_FILENO) {
+            close(infile);
+        }
+        if (bytes < 0) {
+            fprintf(stderr, "Error reading %s.\n", i < argc ? argv[i] : "stdin");
+            free(buf);
+            return EXIT_FAILURE;
+        }
+        total += bytes;
+    }
+    free(buf);
+
+    Dictionary d;
+    if (!dict_train(&d, hist, limit)) {
+        fprintf(stderr, "Failed to limit code lengths to %" PRIu32 " bits.\n", limit);
+        return EXIT_FAILURE;
+    } else if (!dict_save(&d, dir)) {
+        fprintf(stderr, "Failed to save dictionary in %s.\n", dir);
+        return EXIT_FAILURE;
+    }
+    printf("%08" PRIx32 "\n", d.id);
+
+    if (verbose) {
+        uint8_t longest = 0;
+        for (int i = 0; i < ALPHABET; i++) {
+            longest = d.lengths[i] > longest ? d.lengths[i] : longest;
+        }
+        uint64_t bits = coded_bits(hist, d.lengths);
+        fprintf(stderr, "Corpus size: %" PRIu64 " bytes\n", total);
+        fprintf(stderr, "Coded size: %" PRIu64 " bytes\n", (bits + 7) / 8);
+        fprintf(stderr, "Bits per byte: %.3f\n", total ? (double) bits / total : 0.0);
+        fprintf(stderr, "Longest code: %" PRIu8 " bits\n", longest);
+    }
+    return EXIT_SUCCESS;
+}